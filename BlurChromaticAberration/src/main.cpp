@@ -1,6 +1,10 @@
 #define TNZU_DEFINE_INTERFACE
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/color_space.hpp>
+#include <dwango/disc_blur.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
 
 class MyFx : public tnzu::Fx {
  public:
@@ -125,92 +129,111 @@ int MyFx::kernel(Params const& params, Args const& args, cv::Mat& retimg) {
   DEBUG_PRINT("radius_b: " << radius[0]);
   DEBUG_PRINT("margin: " << params.get<int>(PARAM_MARGIN));
 
-  // transform color space
+  std::vector<dwango::disc_kernel> kernels;
+  int pad = 0;
+  for (int c = 0; c < 3; ++c) {
+    int const r = radius[c];
+    kernels.emplace_back(
+        r, (r > 0) ? static_cast<float>(1.0 / (radius_sq[c] * M_PI)) : 1.0f);
+    pad = std::max(pad, kernels.back().radius());
+  }
+
+  auto const converter_table =
+      dwango::shared_linear_color_space_converter<sizeof(value_type) * 8>(
+          exposure, gamma);
+  auto const& converter = *converter_table;
+  auto const encoder_table =
+      dwango::shared_nonlinear_color_space_encoder<value_type>(exposure,
+                                                               gamma);
+  auto const& encoder = *encoder_table;
+
+  float const alpha_scale = 1.0f / std::numeric_limits<value_type>::max();
+
+  cv::Mat const& input = args.get(PORT_INPUT);
+  cv::Point const offset = args.offset(PORT_INPUT);
+  cv::Rect const input_rect =
+      cv::Rect(offset, input.size()) & cv::Rect(cv::Point(0, 0), size);
+
+  // The image is processed in bands of rows, each linearized with pad rows
+  // above and below, blurred and encoded into retimg, so that the float
+  // planes only hold a band instead of the whole frame. Halo rows beyond the
+  // frame are reflected as cv::filter2D would. The band does not grow with
+  // the radius: for large radii the halo dominates the memory anyway, and
+  // linearizing it again per band costs little next to the blur.
+  int const band = std::min(128, size.height);
   std::array<cv::Mat, 4> src = {
-      cv::Mat(size, CV_32F), cv::Mat(size, CV_32F), cv::Mat(size, CV_32F),
-      cv::Mat(size, CV_32F),
+      cv::Mat(band + 2 * pad, size.width, CV_32F),
+      cv::Mat(band + 2 * pad, size.width, CV_32F),
+      cv::Mat(band + 2 * pad, size.width, CV_32F),
+      cv::Mat(band + 2 * pad, size.width, CV_32F),
   };
-  {
-    tnzu::linear_color_space_converter<sizeof(value_type) * 8> converter(
-        exposure, gamma);
-
-    cv::Size const ssize = args.size(PORT_INPUT);
-    std::array<cv::Mat, 4> local = {
-        cv::Mat(src[0], cv::Rect(args.offset(PORT_INPUT), ssize)),
-        cv::Mat(src[1], cv::Rect(args.offset(PORT_INPUT), ssize)),
-        cv::Mat(src[2], cv::Rect(args.offset(PORT_INPUT), ssize)),
-        cv::Mat(src[3], cv::Rect(args.offset(PORT_INPUT), ssize)),
-    };
+  dwango::disc_blur_workspace workspace;
 
-    float const alpha_scale = 1.0f / std::numeric_limits<value_type>::max();
+  for (int y0 = 0; y0 < size.height; y0 += band) {
+    int const y1 = std::min(y0 + band, size.height);
+    int const rows = y1 - y0 + 2 * pad;
 
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-    for (int y = 0; y < ssize.height; y++) {
-      Vec4T const* s = args.get(PORT_INPUT).ptr<Vec4T const>(y);
+    // transform color space
+    dwango::parallel_for(0, rows, [&](int i) {
+      int const y = cv::borderInterpolate(y0 - pad + i, size.height,
+                                          cv::BORDER_REFLECT_101);
       std::array<float*, 4> d = {
-          local[0].ptr<float>(y), local[1].ptr<float>(y),
-          local[2].ptr<float>(y), local[3].ptr<float>(y),
+          src[0].ptr<float>(i), src[1].ptr<float>(i), src[2].ptr<float>(i),
+          src[3].ptr<float>(i),
       };
-      for (int x = 0; x < ssize.width; x++) {
+      for (float* p : d) {
+        std::fill(p, p + size.width, 0.0f);
+      }
+      if ((y < input_rect.y) || (y >= input_rect.y + input_rect.height)) {
+        return;
+      }
+      Vec4T const* s = input.ptr<Vec4T const>(y - offset.y);
+      for (int x = input_rect.x; x < input_rect.x + input_rect.width; x++) {
+        Vec4T const& pixel = s[x - offset.x];
         // color2power
-        d[0][x] = converter[s[x][0]];
-        d[1][x] = converter[s[x][1]];
-        d[2][x] = converter[s[x][2]];
-        d[3][x] = s[x][3] * alpha_scale;
+        d[0][x] = converter[pixel[0]];
+        d[1][x] = converter[pixel[1]];
+        d[2][x] = converter[pixel[2]];
+        d[3][x] = pixel[3] * alpha_scale;
       }
+    });
+
+    // one pass per color and one per distinct disc for alpha (the radii are
+    // often equal), scheduled together as tiles of rows times passes
+    std::vector<cv::Mat> planes;
+    std::vector<dwango::disc_blur_pass> passes;
+    for (int c = 0; c < 4; ++c) {
+      planes.push_back(src[c].rowRange(0, rows));
     }
-  }
-
-  DEBUG_PRINT(__LINE__);
-
-  std::array<cv::Mat, 6> dst;
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int c = 0; c < 3; ++c) {
-    // make filter kernel
-    int const r = radius[c];
-    int const fsize = r * 2 + 1;
-
-    cv::Mat kernel = cv::Mat::zeros(cv::Size(fsize, fsize), CV_32F);
-    if (r > 0) {
-      cv::circle(kernel, cv::Point(r, r), r, cv::Scalar(1), -1);
-      kernel /= (radius_sq[c] * M_PI);
-    } else {
-      kernel = cv::Scalar(1);
+    for (int c = 0; c < 3; ++c) {
+      passes.push_back(dwango::disc_blur_pass{c, kernels[c]});
     }
+    for (int c = 0; c < 3; ++c) {
+      passes.push_back(dwango::disc_blur_pass{3, kernels[c]});
+    }
+    std::vector<cv::Mat> dst;
+    dwango::disc_blur(planes, passes, dst, cv::Range(pad, pad + y1 - y0),
+                      workspace);
+
+    // transform color space
+    dwango::parallel_for(y0, y1, [&](int y) {
+      std::array<float const*, 6> s = {
+          dst[0].ptr<float const>(y - y0), dst[1].ptr<float const>(y - y0),
+          dst[2].ptr<float const>(y - y0), dst[3].ptr<float const>(y - y0),
+          dst[4].ptr<float const>(y - y0), dst[5].ptr<float const>(y - y0),
+      };
+      Vec4T* d = retimg.ptr<Vec4T>(y);
+      std::vector<cv::Vec4f> bgra(size.width);
+      for (int x = 0; x < size.width; ++x) {
+        bgra[x] = cv::Vec4f(s[0][x], s[1][x], s[2][x],
+                            (s[3][x] * (1.0f - s[4][x]) + s[4][x]) *
+                                    (1.0f - s[5][x]) +
+                                s[5][x]);
+      }
 
-    // apply filter
-    cv::filter2D(src[c], dst[c + 0], -1, kernel);
-    cv::filter2D(src[3], dst[c + 3], -1, kernel);
-  }
-
-  DEBUG_PRINT(__LINE__);
-// transform color space
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int y = 0; y < size.height; ++y) {
-    std::array<float const*, 6> s = {
-        dst[0].ptr<float const>(y), dst[1].ptr<float const>(y),
-        dst[2].ptr<float const>(y), dst[3].ptr<float const>(y),
-        dst[4].ptr<float const>(y), dst[5].ptr<float const>(y),
-    };
-    Vec4T* d = retimg.ptr<Vec4T>(y);
-    for (int x = 0; x < size.width; ++x) {
       // sRGB (straight alpha)
-      cv::Vec4f const sbgra(
-          tnzu::to_nonlinear_color_space(s[0][x], exposure, gamma),
-          tnzu::to_nonlinear_color_space(s[1][x], exposure, gamma),
-          tnzu::to_nonlinear_color_space(s[2][x], exposure, gamma),
-          (s[3][x] * (1.0f - s[4][x]) + s[4][x]) * (1.0f - s[5][x]) + s[5][x]);
-
-      for (int c = 0; c < 4; ++c) {
-        d[x][c] = tnzu::normalize_cast<value_type>(sbgra[c]);
-      }
-    }
+      encoder(bgra.data(), d, size.width);
+    });
   }
 
   return 0;
@@ -225,5 +248,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(); }
 }
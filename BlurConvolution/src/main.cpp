@@ -2,6 +2,10 @@
 #define TNZU_ENABLE_USERDATA
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
+
+#include <mutex>
 
 // resize for filter
 cv::Mat resize(cv::Mat const& src, cv::Size const& max_size, float scale) {
@@ -38,19 +42,40 @@ cv::Mat resize(cv::Mat const& src, cv::Size const& max_size, float scale) {
   return dst;
 }
 
-// dft
-cv::Mat dft(cv::Mat const& src, double const intensity = 1) {
-  std::array<cv::Mat, 2> planes = {
-      cv::Mat_<float>(src) * intensity, cv::Mat::zeros(src.size(), CV_32F),
-  };
-
-  cv::Mat dst;
-  cv::merge(planes.data(), 2, dst);
-  cv::dft(dst, dst);
+// real-to-complex dft, packed in the CCS format that mulSpectrums takes.
+// Rows from nonzero_rows on are known to be zero and are not transformed.
+cv::Mat dft(cv::Mat const& src, double const intensity = 1,
+            int const nonzero_rows = 0) {
+  cv::Mat dst = cv::Mat_<float>(src) * intensity;
+  cv::dft(dst, dst, 0, nonzero_rows);
 
   return dst;
 }
 
+// spectra of the four channels of a kernel image, normalized by the sum of
+// its gray levels
+std::array<cv::Mat, 4> kernel_spectra(cv::Mat const& image,
+                                      cv::Size const& osize, float scale,
+                                      float intensity) {
+  cv::Mat a = resize(image, osize, scale);
+  cv::Mat g;
+  cv::cvtColor(a, g, cv::COLOR_BGRA2GRAY);
+  double k = 1;
+  double const sum = cv::sum(cv::Mat_<float>(g))[0];
+  if (sum > 0.0) {
+    k /= sum;
+  }
+
+  std::array<cv::Mat, 4> planes;
+  cv::split(a, planes.data());
+
+  std::array<cv::Mat, 4> spectra;
+  dwango::parallel_for(0, 4, [&](int c) {
+    spectra[c] = dft(planes[c], ((c == 3) ? 1 : intensity) * k);
+  });
+  return spectra;
+}
+
 class MyFx : public tnzu::Fx {
  public:
   //
@@ -131,6 +156,35 @@ class MyFx : public tnzu::Fx {
     return 0;
   }
 
+  // The kernel images are usually the same for a whole shot, so the spectra
+  // of the last kernel on each port are kept with the instance and reused
+  // while the image, its scale and intensity, and the DFT size are unchanged.
+  std::array<cv::Mat, 4> spectra(Args const& args, int port, float scale,
+                                 float intensity, cv::Size const& osize) {
+    std::uint64_t key = dwango::detail::hash_mat(args.get(port), 0);
+    key = dwango::detail::hash_value(key, scale);
+    key = dwango::detail::hash_value(key, intensity);
+    key = dwango::detail::hash_value(key, osize.width);
+    key = dwango::detail::hash_value(key, osize.height);
+
+    cached_spectra& cached = spectra_[port - PORT_A];
+    {
+      std::lock_guard<std::mutex> lock(spectra_mutex_);
+      if (!cached.spectra[0].empty() && (cached.key == key)) {
+        DEBUG_PRINT("kernel spectra cache hit");
+        return cached.spectra;
+      }
+    }
+
+    std::array<cv::Mat, 4> const result =
+        kernel_spectra(args.get(port), osize, scale, intensity);
+
+    std::lock_guard<std::mutex> lock(spectra_mutex_);
+    cached.key = key;
+    cached.spectra = result;
+    return result;
+  }
+
   int compute(Config const& config, Params const& params, Args const& args,
               cv::Mat& retimg) override try {
     DEBUG_PRINT(__FUNCTION__);
@@ -163,101 +217,68 @@ class MyFx : public tnzu::Fx {
     cv::split(args.get(PORT_INPUT), I.data());
 
     std::array<cv::Mat, 4> A;
-    double ka = 1;
     if (input_a) {
-      cv::Mat a = resize(args.get(PORT_A), osize, scale_a);
-      cv::Mat g;
-      cv::cvtColor(a, g, cv::COLOR_BGRA2GRAY);
-      cv::split(g, A.data());
-      double const sum = cv::sum(cv::Mat_<float>(A[0]))[0];
-      if (sum > 0.0) {
-        ka /= sum;
-      }
-      cv::split(a, A.data());
+      A = spectra(args, PORT_A, scale_a, intensity_a, osize);
     }
 
     std::array<cv::Mat, 4> B;
-    double kb = 1;
     if (input_b) {
-      cv::Mat b = resize(args.get(PORT_B), osize, scale_b);
-      cv::Mat g;
-      cv::cvtColor(b, g, cv::COLOR_BGRA2GRAY);
-      cv::split(g, B.data());
-      double const sum = cv::sum(cv::Mat_<float>(B[0]))[0];
-      if (sum > 0.0) {
-        kb /= sum;
-      }
-      cv::split(b, B.data());
+      B = spectra(args, PORT_B, scale_b, intensity_b, osize);
     }
 
     std::array<cv::Mat, 4> C;
-    double kc = 1;
     if (input_c) {
-      cv::Mat c = resize(args.get(PORT_C), osize, scale_c);
-      cv::Mat g;
-      cv::cvtColor(c, g, cv::COLOR_BGRA2GRAY);
-      cv::split(g, C.data());
-      double const sum = cv::sum(cv::Mat_<float>(C[0]))[0];
-      if (sum > 0.0) {
-        kc /= sum;
-      }
-      cv::split(c, C.data());
+      C = spectra(args, PORT_C, scale_c, intensity_c, osize);
     }
 
     // donot use filter2D to apply dft only once for each Mat
     std::array<cv::Mat, 4> R;
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-    for (int c = 0; c < 4; ++c) {
+    dwango::parallel_for(0, 4, [&](int c) {
       cv::Mat paddedI;
       cv::copyMakeBorder(I[c], paddedI, margin,
                          osize.height - (isize.height + margin), margin,
                          osize.width - (isize.width + margin),
                          cv::BORDER_CONSTANT, cv::Scalar::all(0));
 
-      cv::Mat complexI = dft(paddedI);
+      cv::Mat spectrumI = dft(paddedI, 1, isize.height + margin);
       if (input_a) {
-        cv::Mat complexA = dft(A[c], ((c == 3) ? 1 : intensity_a) * ka);
-        cv::mulSpectrums(complexI, complexA, complexI, 0);
+        cv::mulSpectrums(spectrumI, A[c], spectrumI, 0);
       }
       if (input_b) {
-        cv::Mat complexB = dft(B[c], ((c == 3) ? 1 : intensity_b) * kb);
-        cv::mulSpectrums(complexI, complexB, complexI, 0);
+        cv::mulSpectrums(spectrumI, B[c], spectrumI, 0);
       }
       if (input_c) {
-        cv::Mat complexC = dft(C[c], ((c == 3) ? 1 : intensity_c) * kc);
-        cv::mulSpectrums(complexI, complexC, complexI, 0);
+        cv::mulSpectrums(spectrumI, C[c], spectrumI, 0);
       }
 
-      cv::idft(complexI, complexI, cv::DFT_SCALE);
+      // only the rows of msize are kept
+      cv::Mat result;
+      cv::idft(spectrumI, result, cv::DFT_SCALE | cv::DFT_REAL_OUTPUT,
+               msize.height);
 
-      std::array<cv::Mat, 2> planes;
-      cv::split(complexI, planes.data());
-
-      planes[0] = planes[0](cv::Rect(cv::Point(0, 0), msize));
+      result = result(cv::Rect(cv::Point(0, 0), msize));
       if (retimg.type() == CV_8UC4) {
         using value_type = uchar;
 
-        planes[0].forEach<float>([max_value](float& value, void const*) {
+        result.forEach<float>([max_value](float& value, void const*) {
           if (value > 0.0f) {
             value = tnzu::normalize_cast<value_type>(value / max_value);
           }
         });
 
-        R[c] = cv::Mat_<value_type>(planes[0]);
+        R[c] = cv::Mat_<value_type>(result);
       } else {
         using value_type = ushort;
 
-        planes[0].forEach<float>([max_value](float& value, void const*) {
+        result.forEach<float>([max_value](float& value, void const*) {
           if (value > 0.0f) {
             value = tnzu::normalize_cast<value_type>(value / max_value);
           }
         });
 
-        R[c] = cv::Mat_<value_type>(planes[0]);
+        R[c] = cv::Mat_<value_type>(result);
       }
-    }
+    });
 
     cv::Mat dst;
     cv::merge(R.data(), R.size(), dst);
@@ -270,6 +291,15 @@ class MyFx : public tnzu::Fx {
   } catch (cv::Exception const& e) {
     DEBUG_PRINT(e.what());
   }
+
+ private:
+  struct cached_spectra {
+    std::uint64_t key;
+    std::array<cv::Mat, 4> spectra;
+  };
+
+  std::mutex spectra_mutex_;
+  std::array<cached_spectra, PORT_COUNT - PORT_A> spectra_;
 };
 
 namespace tnzu {
@@ -281,5 +311,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(); }
 }
@@ -1,6 +1,8 @@
 #define TNZU_DEFINE_INTERFACE
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
 
 class MyFx : public tnzu::Fx {
  public:
@@ -138,11 +140,8 @@ int MyFx::kernel(Params const& params, Args const& args, cv::Mat& retimg) {
   float const length = gain * size.height * 0.5f;
   DEBUG_PRINT("length = " << length);
 
-// generate curl noise
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int y = 0; y < size.height; ++y) {
+  // generate curl noise
+  dwango::parallel_for(0, size.height, [&](int y) {
     Vec4T* dst = retimg.ptr<Vec4T>(y);
 
     int const y0 = cv::borderInterpolate(y - 1, field.rows, cv::BORDER_WRAP);
@@ -200,7 +199,7 @@ int MyFx::kernel(Params const& params, Args const& args, cv::Mat& retimg) {
       }
       dst[x] = color;
     }
-  }
+  });
 
   return 0;
 }
@@ -214,5 +213,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(); }
 }
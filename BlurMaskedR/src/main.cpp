@@ -1,6 +1,9 @@
 #define TNZU_DEFINE_INTERFACE
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/color_space.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
 
 class MyFx : public tnzu::Fx {
  public:
@@ -89,8 +92,13 @@ int MyFx::kernel(Params const& params, Args const& args, cv::Mat& retimg) {
 
   float const gamma = 2.2f;
 
-  tnzu::linear_color_space_converter<sizeof(value_type) * 8> converter(1.0f,
-                                                                       gamma);
+  auto const converter_table =
+      dwango::shared_linear_color_space_converter<sizeof(value_type) * 8>(
+          1.0f, gamma);
+  auto const& converter = *converter_table;
+  auto const encoder_table =
+      dwango::shared_nonlinear_color_space_encoder<value_type>(1.0f, gamma);
+  auto const& encoder = *encoder_table;
   float const alpha_scale = 1.0f / std::numeric_limits<value_type>::max();
 
   cv::Size const size = retimg.size();
@@ -116,10 +124,7 @@ int MyFx::kernel(Params const& params, Args const& args, cv::Mat& retimg) {
     args.get(PORT_MASK).copyTo(mask(args.rect(PORT_MASK)));
   }
 
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int y = 0; y < size.height; ++y) {
+  dwango::parallel_for(0, size.height, [&](int y) {
     Vec4T const* m = mask.ptr<Vec4T const>(y);
     Vec4T* d = retimg.ptr<Vec4T>(y);
 
@@ -149,8 +154,7 @@ int MyFx::kernel(Params const& params, Args const& args, cv::Mat& retimg) {
             color += converter[sample[c]];
           }
 
-          d[x][c] = tnzu::normalize_cast<value_type>(
-              tnzu::to_nonlinear_color_space(color / it.count, 1.0f, gamma));
+          d[x][c] = encoder(color / it.count);
         }
       }
       {
@@ -172,7 +176,7 @@ int MyFx::kernel(Params const& params, Args const& args, cv::Mat& retimg) {
         }
       }
     }
-  }
+  });
 
   return 0;
 }
@@ -186,5 +190,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(); }
 }
@@ -1,6 +1,63 @@
 #define TNZU_DEFINE_INTERFACE
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/color_cache.hpp>
+#include <dwango/color_space.hpp>
+#include <dwango/cpu_features.hpp>
+#include <dwango/layer_coverage.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
+#include <dwango/singleton.hpp>
+#include <dwango/tile_map.hpp>
+
+#include <string>
+
+// ComposeAdd64 builds this file with 64 ports
+#ifndef COMPOSE_ADD_PORT_COUNT
+#define COMPOSE_ADD_PORT_COUNT 10
+#endif
+
+// "layer0", "layer1", ...
+struct port_names {
+  port_names() {
+    for (int i = 0; i < COMPOSE_ADD_PORT_COUNT; ++i) {
+      names[i] = "layer" + std::to_string(i);
+    }
+  }
+
+  std::array<std::string, COMPOSE_ADD_PORT_COUNT> names;
+};
+
+#if defined(DWANGO_AVX2_KERNELS)
+// add_pixels for the leading multiple of 8 pixels; returns the number of
+// floats done
+DWANGO_TARGET_AVX2 inline int add_pixels_avx2(float const* s, float* d,
+                                              int count) {
+  int i = 0;
+  for (; i + 32 <= count * 4; i += 32) {
+    for (int k = i; k < i + 32; k += 8) {
+      _mm256_storeu_ps(
+          d + k, _mm256_add_ps(_mm256_loadu_ps(s + k), _mm256_loadu_ps(d + k)));
+    }
+  }
+  return i;
+}
+#endif
+
+// b[i] = a[i] + b[i] for count pixels
+inline void add_pixels(cv::Vec4f const* a, cv::Vec4f* b, int count) {
+  float const* s = a[0].val;
+  float* d = b[0].val;
+  int i = 0;
+#if defined(DWANGO_AVX2_KERNELS)
+  if (dwango::cpu_features::instance().avx2) {
+    i = add_pixels_avx2(s, d, count);
+  }
+#endif
+  for (; i < count * 4; ++i) {
+    d[i] = s[i] + d[i];
+  }
+}
 
 class MyFx : public tnzu::Fx {
  public:
@@ -9,26 +66,13 @@ class MyFx : public tnzu::Fx {
   //
   enum {
     PORT_INPUT_0,
-    PORT_INPUT_1,
-    PORT_INPUT_2,
-    PORT_INPUT_3,
-    PORT_INPUT_4,
-    PORT_INPUT_5,
-    PORT_INPUT_6,
-    PORT_INPUT_7,
-    PORT_INPUT_8,
-    PORT_INPUT_9,
-    PORT_COUNT,
+    PORT_COUNT = PORT_INPUT_0 + COMPOSE_ADD_PORT_COUNT,
   };
 
   int port_count() const override { return PORT_COUNT; }
 
   char const* port_name(int i) const override {
-    static std::array<char const*, PORT_COUNT> names = {
-        "layer0", "layer1", "layer2", "layer3", "layer4",
-        "layer5", "layer6", "layer7", "layer8", "layer9",
-    };
-    return names[i];
+    return dwango::detail::singleton<port_names>::instance.names[i].c_str();
   }
 
   //
@@ -86,72 +130,159 @@ int MyFx::kernel(Config const& config, Params const& params, Args const& args,
 
   float const gamma = 2.2f;
 
-  cv::Mat accum(retimg.size(), CV_32FC4, cv::Scalar(0, 0, 0, 0));
+  // Colors are summed in linear BGR. The sRGB <-> XYZ conversions are linear,
+  // so summing in XYZ only added two 3x3 matrix multiplies per pixel.
+  auto const decoder_table =
+      dwango::shared_linear_color_space_decoder<value_type>(1.0f, gamma);
+  auto const& decoder = *decoder_table;
+
+  auto const encoder_table =
+      dwango::shared_nonlinear_color_space_encoder<value_type>(1.0f, gamma);
+  auto const& encoder = *encoder_table;
+
+  // the result of a pixel that no other layer overlaps; identical to the
+  // accumulated path since 0 + v == v
+  auto const to_pixel = [&](Vec4T const& c) {
+    cv::Vec4f const v = decoder(c);
+    Vec4T pixel;
+    encoder(&v, &pixel, 1);
+    return pixel;
+  };
+
+  struct layer {
+    layer(cv::Mat const& image, cv::Rect const& rect)
+        : image(image), rect(rect), tiles(image) {}
 
-  tnzu::linear_color_space_converter<sizeof(value_type) * 8> converter(1.0f,
-                                                                       gamma);
-  float const alpha_scale = 1.0f / std::numeric_limits<value_type>::max();
+    cv::Mat image;
+    cv::Rect rect;
+    dwango::tile_map tiles;  // transparent tiles add nothing
+  };
 
+  std::vector<layer> layers;
+  std::vector<cv::Rect> rects;
   for (int i = 0, argc = args.count(); i < argc; ++i) {
-    if (args.invalid(i)) {
-      continue;
+    if (args.valid(i)) {
+      layers.emplace_back(args.get(i), args.rect(i));
+      rects.push_back(args.rect(i));
     }
+  }
 
-    cv::Size const size = args.size(i);
+  // tiles of retimg that any layer contributes to
+  dwango::tile_map used(retimg.size());
+  for (layer const& l : layers) {
+    used.merge(l.tiles, l.rect.tl());
+  }
 
-    cv::Mat local_view(accum, args.rect(i));
+  // segments of retimg covered by no layer, by a single layer or by several
+  dwango::layer_coverage const coverage(retimg.size(), rects);
 
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-    for (int y = 0; y < size.height; y++) {
-      Vec4T const* src = args.get(i).ptr<Vec4T const>(y);
-      cv::Vec4f* dst = local_view.ptr<cv::Vec4f>(y);
-
-      for (int x = 0; x < size.width; x++) {
-        // linear sRGB (straight alpha)
-        cv::Vec3f const bgr(converter[src[x][0]],   // blue
-                            converter[src[x][1]],   // green
-                            converter[src[x][2]]);  // red
-        float const alpha = src[x][3] * alpha_scale;
-
-        // XYZ color space (D65)
-        cv::Vec3f const xyz = tnzu::to_xyz(bgr);
-
-        dst[x][0] += xyz[0];
-        dst[x][1] += xyz[1];
-        dst[x][2] += xyz[2];
-        dst[x][3] += alpha;
-      }
-    }
+  // Where layers overlap, their sum is reduced pairwise in linear float, one
+  // chunk of a row at a time, and encoded once at the end. The chunk buffers
+  // stay in L1 and no full-frame float image is allocated.
+  int const chunk = 256;
+  int levels = 1;
+  while ((1 << levels) <= PORT_COUNT) {
+    ++levels;
   }
 
   cv::Size const size = retimg.size();
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int y = 0; y < size.height; y++) {
-    Vec4T* dst = retimg.ptr<Vec4T>(y);
-    cv::Vec4f const* src = accum.ptr<cv::Vec4f const>(y);
-
-    for (int x = 0; x < size.width; x++) {
-      // XYZ color space: {X, Y, Z}
-      cv::Vec3f const xyz(src[x][0], src[x][1], src[x][2]);
-
-      // linear RGB
-      cv::Vec3f const bgr = tnzu::to_bgr(xyz);
-
-      // sRGB (straight alpha)
-      cv::Vec4f const color(tnzu::to_nonlinear_color_space(bgr[0], 1.0f, gamma),
-                            tnzu::to_nonlinear_color_space(bgr[1], 1.0f, gamma),
-                            tnzu::to_nonlinear_color_space(bgr[2], 1.0f, gamma),
-                            src[x][3]);
-
-      for (int c = 0; c < 4; c++) {
-        dst[x][c] = tnzu::normalize_cast<value_type>(color[c]);
-      }
+  dwango::parallel_for_blocks(0, size.height, [&](int y0, int y1) {
+    // cels repeat a few hundred colors
+    dwango::color_cache<Vec4T> pixel_cache;
+
+    // partial[l] holds the sum of 2^l layers while filled[l] is set
+    std::vector<cv::Vec4f> storage((levels + 1) * chunk);
+    std::vector<cv::Vec4f*> partial(levels);
+    for (int l = 0; l < levels; l++) {
+      partial[l] = storage.data() + l * chunk;
     }
-  }
+    cv::Vec4f* scratch = storage.data() + levels * chunk;
+    std::vector<char> filled(levels);
+
+    for (int y = y0; y < y1; y++) {
+      Vec4T* dst = retimg.ptr<Vec4T>(y);
+
+      coverage.segments(y, [&](int x0, int x1, int const* index, int count) {
+        if (count == 0) {
+          std::fill(dst + x0, dst + x1, Vec4T());
+          return;
+        }
+
+        if (count == 1) {
+          layer const& l = layers[index[0]];
+          cv::Mat const& image = l.image;
+          Vec4T const* src = image.ptr<Vec4T const>(y - l.rect.y);
+          Vec4T* out = dst + l.rect.x;
+
+          l.tiles.spans(y - l.rect.y, x0 - l.rect.x, x1 - l.rect.x,
+                        [&](int u0, int u1, bool occupied) {
+                          if (!occupied) {
+                            std::fill(out + u0, out + u1, Vec4T());
+                            return;
+                          }
+                          for (int u = u0; u < u1; u++) {
+                            out[u] = pixel_cache(src[u], to_pixel);
+                          }
+                        });
+          return;
+        }
+
+        used.spans(y, x0, x1, [&](int u0, int u1, bool occupied) {
+          if (!occupied) {
+            std::fill(dst + u0, dst + u1, Vec4T());
+            return;
+          }
+
+          for (int c0 = u0; c0 < u1; c0 += chunk) {
+            int const c1 = std::min(c0 + chunk, u1);
+            int const n = c1 - c0;
+            std::fill(filled.begin(), filled.end(), 0);
+
+            for (int k = 0; k < count; k++) {
+              layer const& l = layers[index[k]];
+              cv::Mat const& image = l.image;
+              Vec4T const* src = image.ptr<Vec4T const>(y - l.rect.y);
+              cv::Vec4f* t = scratch + (l.rect.x - c0);
+
+              std::fill(scratch, scratch + n, cv::Vec4f());
+              l.tiles.spans(y - l.rect.y, c0 - l.rect.x, c1 - l.rect.x,
+                            [&](int v0, int v1, bool occupied) {
+                              if (!occupied) {
+                                return;
+                              }
+                              decoder(src + v0, t + v0, v1 - v0);
+                            });
+
+              // carry into the partial sums like a binary counter
+              int level = 0;
+              for (; filled[level]; level++) {
+                add_pixels(partial[level], scratch, n);
+                filled[level] = 0;
+              }
+              std::swap(scratch, partial[level]);
+              filled[level] = 1;
+            }
+
+            // remaining partial sums, earlier layers on the left
+            cv::Vec4f* sum = nullptr;
+            for (int level = 0; level < levels; level++) {
+              if (!filled[level]) {
+                continue;
+              }
+              if (sum) {
+                add_pixels(partial[level], sum, n);
+              } else {
+                sum = partial[level];
+              }
+            }
+
+            // sRGB (straight alpha)
+            encoder(sum, dst + c0, n);
+          }
+        });
+      });
+    }
+  });
   return 0;
 }
 
@@ -164,5 +295,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(); }
 }
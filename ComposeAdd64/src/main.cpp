@@ -0,0 +1,4 @@
+// ComposeAdd with 64 input ports, for particle and crowd passes that would
+// otherwise chain several ComposeAdd nodes and re-encode at every hop.
+#define COMPOSE_ADD_PORT_COUNT 64
+#include "../../ComposeAdd/src/main.cpp"
@@ -1,6 +1,14 @@
 #define TNZU_DEFINE_INTERFACE
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/color_cache.hpp>
+#include <dwango/color_space.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
+#include <dwango/tile_map.hpp>
+
+#include <array>
+#include <cstdint>
 
 class MyFx : public tnzu::Fx {
  public:
@@ -90,100 +98,227 @@ int MyFx::kernel(Config const& config, Params const& params, Args const& args,
 
   float const gamma = 2.2f;
 
-  cv::Mat accum(retimg.size(), CV_32FC4, cv::Scalar(0, 0, 0, 0));
+  // every layer is linearized through the same table
+  auto const decoder_table =
+      dwango::shared_linear_color_space_decoder<value_type>(1.0f, gamma);
+  auto const& decoder = *decoder_table;
 
-  tnzu::linear_color_space_converter<sizeof(value_type) * 8> converter(1.0f,
-                                                                       gamma);
-  float const alpha_scale = 1.0f / std::numeric_limits<value_type>::max();
+  auto const to_xyza = [&](Vec4T const& c) {
+    // linear sRGB (straight alpha)
+    cv::Vec4f const bgra = decoder(c);
 
-  {
-    cv::Size const size = args.size(0);
+    // XYZ color space (D65)
+    cv::Vec3f const xyz =
+        tnzu::to_xyz(cv::Vec3f(bgra[0], bgra[1], bgra[2]));
 
-    cv::Mat local_view(accum, args.rect(0));
+    return cv::Vec4f(xyz[0], xyz[1], xyz[2], bgra[3]);
+  };
 
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-    for (int y = 0; y < size.height; y++) {
-      Vec4T const* src = args.get(0).ptr<Vec4T const>(y);
-      cv::Vec4f* dst = local_view.ptr<cv::Vec4f>(y);
+  auto const to_xyz = [&](Vec4T const& c) {
+    // linear sRGB
+    cv::Vec3f const bgr(decoder[c[0]],   // blue
+                        decoder[c[1]],   // green
+                        decoder[c[2]]);  // red
 
-      for (int x = 0; x < size.width; x++) {
-        // linear sRGB (straight alpha)
-        cv::Vec3f const bgr(converter[src[x][0]],   // blue
-                            converter[src[x][1]],   // green
-                            converter[src[x][2]]);  // red
-        float const alpha = src[x][3] * alpha_scale;
+    // XYZ color space (D65)
+    return tnzu::to_xyz(bgr);
+  };
 
-        // XYZ color space (D65)
-        cv::Vec3f const xyz = tnzu::to_xyz(bgr);
+  auto const encoder_table =
+      dwango::shared_nonlinear_color_space_encoder<value_type>(1.0f, gamma);
+  auto const& encoder = *encoder_table;
 
-        dst[x][0] = xyz[0];
-        dst[x][1] = xyz[1];
-        dst[x][2] = xyz[2];
-        dst[x][3] = alpha;
-      }
-    }
-  }
+  struct layer {
+    layer(cv::Mat const& image, cv::Rect const& rect)
+        : image(image), rect(rect), tiles(image) {}
 
-  for (int i = 1, argc = args.count(); i < argc; ++i) {
-    if (args.invalid(i)) {
-      continue;
-    }
+    cv::Mat image;
+    cv::Rect rect;
+    dwango::tile_map tiles;  // transparent tiles multiply by black
+  };
 
-    cv::Size const size = args.size(i);
+  // layers[0] is the first layer
+  std::vector<layer> layers;
+  for (int i = 0, argc = args.count(); i < argc; ++i) {
+    if ((i == 0) || args.valid(i)) {
+      layers.emplace_back(args.get(i), args.rect(i));
+    }
+  }
 
-    cv::Mat local_view(accum, args.rect(i));
+  // the result is transparent wherever the first layer is
+  dwango::tile_map used(retimg.size());
+  used.merge(layers[0].tiles, layers[0].rect.tl());
 
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-    for (int y = 0; y < size.height; y++) {
-      Vec4T const* src = args.get(i).ptr<Vec4T const>(y);
-      cv::Vec4f* dst = local_view.ptr<cv::Vec4f>(y);
+  int const tile = dwango::tile_map::tile_size;
 
-      for (int x = 0; x < size.width; x++) {
-        // linear sRGB (straight alpha)
-        cv::Vec3f const bgr(std::pow(src[x][0] * alpha_scale, gamma),   // blue
-                            std::pow(src[x][1] * alpha_scale, gamma),   // green
-                            std::pow(src[x][2] * alpha_scale, gamma));  // red
+  // pixels of a tile of retimg, one bit per pixel and a word per row
+  static_assert(dwango::tile_map::tile_size <= 64, "a row must fit a word");
+  typedef std::array<std::uint64_t, dwango::tile_map::tile_size> tile_mask;
+  auto const bits = [](int n) {
+    return (n >= 64) ? ~std::uint64_t(0) : ((std::uint64_t(1) << n) - 1);
+  };
 
-        // XYZ color space (D65)
-        cv::Vec3f const xyz = tnzu::to_xyz(bgr);
+  // adds the pixels of rect (a tile of retimg) that layer l multiplies by
+  // black to mask: its transparent and uniformly black tiles
+  auto const blacken = [tile, &bits](layer const& l, cv::Rect const& rect,
+                                     tile_mask& mask) {
+    cv::Rect const local = (rect & l.rect) - l.rect.tl();
+    if (local.empty()) {
+      return;
+    }
+    for (int ty = local.y / tile; ty <= (local.br().y - 1) / tile; ty++) {
+      for (int tx = local.x / tile; tx <= (local.br().x - 1) / tile; tx++) {
+        switch (l.tiles.state(tx, ty)) {
+          case dwango::tile_map::empty:
+            break;
+          case dwango::tile_map::uniform: {
+            cv::Mat const& image = l.image;
+            Vec4T const& c = image.at<Vec4T>(ty * tile, tx * tile);
+            if (c[0] || c[1] || c[2]) {
+              continue;
+            }
+          } break;
+          default:
+            continue;
+        }
+        cv::Rect const part =
+            (local & cv::Rect(tx * tile, ty * tile, tile, tile)) +
+            l.rect.tl() - rect.tl();
+        std::uint64_t const row = bits(part.width) << part.x;
+        for (int y = part.y; y < part.br().y; y++) {
+          mask[y] |= row;
+        }
+      }
+    }
+  };
 
-        dst[x][0] *= xyz[0];
-        dst[x][1] *= xyz[1];
-        dst[x][2] *= xyz[2];
+  // A product cannot recover from zero: dead[t] is the first layer after
+  // which every pixel of tile t of retimg is black, and the layers above
+  // skip the tile. The black pixels may come from different layers, as
+  // long as each lies in a transparent or uniformly black tile of its layer.
+  // Tiles that are transparent in the first layer are dead from the start.
+  int const layer_count = static_cast<int>(layers.size());
+  std::vector<int> dead(used.cols() * used.rows(), layer_count);
+  dwango::parallel_for(0, used.rows(), [&](int ty) {
+    for (int tx = 0; tx < used.cols(); tx++) {
+      if (!used.occupied(tx, ty)) {
+        dead[ty * used.cols() + tx] = -1;
+        continue;
+      }
+      cv::Rect const rect = used.tile_rect(tx, ty);
+      std::uint64_t const full = bits(rect.width);
+      tile_mask mask = {};
+      for (int i = 0; i < layer_count; i++) {
+        blacken(layers[i], rect, mask);
+        if (std::all_of(mask.begin(), mask.begin() + rect.height,
+                        [full](std::uint64_t m) { return m == full; })) {
+          dead[ty * used.cols() + tx] = i;
+          break;
+        }
       }
     }
+  });
+  int occupied_tiles = 0;
+  int dead_tiles = 0;
+  for (int d : dead) {
+    occupied_tiles += (d >= 0) ? 1 : 0;
+    dead_tiles += ((d >= 0) && (d + 1 < layer_count)) ? 1 : 0;
   }
+  DEBUG_PRINT("skipped tiles: " << dead_tiles << " / " << occupied_tiles);
 
+  // All layers are multiplied into a one-row buffer that is encoded right
+  // away, so no full-frame float image is allocated.
   cv::Size const size = retimg.size();
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int y = 0; y < size.height; y++) {
-    Vec4T* dst = retimg.ptr<Vec4T>(y);
-    cv::Vec4f const* src = accum.ptr<cv::Vec4f const>(y);
-
-    for (int x = 0; x < size.width; x++) {
-      // XYZ color space: {X, Y, Z}
-      cv::Vec3f const xyz(src[x][0], src[x][1], src[x][2]);
-
-      // linear RGB
-      cv::Vec3f const bgr = tnzu::to_bgr(xyz);
-
-      // sRGB (straight alpha)
-      cv::Vec4f const color(tnzu::to_nonlinear_color_space(bgr[0], 1.0f, gamma),
-                            tnzu::to_nonlinear_color_space(bgr[1], 1.0f, gamma),
-                            tnzu::to_nonlinear_color_space(bgr[2], 1.0f, gamma),
-                            src[x][3]);
-
-      for (int c = 0; c < 4; c++) {
-        dst[x][c] = tnzu::normalize_cast<value_type>(color[c]);
+  dwango::parallel_for_blocks(0, size.height, [&](int y0, int y1) {
+    // cels repeat a few hundred colors
+    dwango::color_cache<cv::Vec4f> first_cache;
+    dwango::color_cache<cv::Vec3f> cache;
+    std::vector<cv::Vec4f> accum(size.width);
+
+    for (int y = y0; y < y1; y++) {
+      Vec4T* dst = retimg.ptr<Vec4T>(y);
+
+      used.spans(y, [&](int x0, int x1, bool occupied) {
+        if (occupied) {
+          std::fill(accum.data() + x0, accum.data() + x1, cv::Vec4f());
+        } else {
+          std::fill(dst + x0, dst + x1, Vec4T());
+        }
+      });
+
+      for (int i = 0; i < layer_count; i++) {
+        layer const& l = layers[i];
+        int const ly = y - l.rect.y;
+        if ((ly < 0) || (ly >= l.rect.height)) {
+          continue;
+        }
+        cv::Mat const& image = l.image;
+        Vec4T const* src = image.ptr<Vec4T const>(ly);
+        cv::Vec4f* acc = accum.data() + l.rect.x;
+
+        auto const apply = [&](int x0, int x1, bool occupied) {
+          if (i == 0) {
+            // transparent tiles leave accum cleared
+            if (occupied) {
+              for (int x = x0; x < x1; x++) {
+                acc[x] = first_cache(src[x], to_xyza);
+              }
+            }
+            return;
+          }
+          if (!occupied) {
+            // multiplying by black
+            for (int x = x0; x < x1; x++) {
+              acc[x] = cv::Vec4f(0, 0, 0, acc[x][3]);
+            }
+            return;
+          }
+          for (int x = x0; x < x1; x++) {
+            cv::Vec3f const xyz = cache(src[x], to_xyz);
+
+            acc[x][0] *= xyz[0];
+            acc[x][1] *= xyz[1];
+            acc[x][2] *= xyz[2];
+          }
+        };
+
+        // runs of tiles that are still alive at layer i
+        int const* row = &dead[(y / tile) * used.cols()];
+        int tx = 0;
+        while (tx < used.cols()) {
+          bool const alive = row[tx] >= i;
+          int end = tx + 1;
+          while ((end < used.cols()) && ((row[end] >= i) == alive)) {
+            ++end;
+          }
+          if (alive) {
+            int const x0 = tx * tile;
+            int const x1 = std::min(end * tile, size.width);
+            l.tiles.spans(ly, x0 - l.rect.x, x1 - l.rect.x, apply);
+          }
+          tx = end;
+        }
       }
+
+      used.spans(y, [&](int x0, int x1, bool occupied) {
+        if (!occupied) {
+          return;
+        }
+        for (int x = x0; x < x1; x++) {
+          // XYZ color space: {X, Y, Z}
+          cv::Vec3f const xyz(accum[x][0], accum[x][1], accum[x][2]);
+
+          // linear RGB
+          cv::Vec3f const bgr = tnzu::to_bgr(xyz);
+
+          accum[x] = cv::Vec4f(bgr[0], bgr[1], bgr[2], accum[x][3]);
+        }
+
+        // sRGB (straight alpha)
+        encoder(accum.data() + x0, dst + x0, x1 - x0);
+      });
     }
-  }
+  });
   return 0;
 }
 
@@ -196,5 +331,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(); }
 }
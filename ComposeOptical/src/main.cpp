@@ -1,6 +1,72 @@
 #define TNZU_DEFINE_INTERFACE
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/color_cache.hpp>
+#include <dwango/color_space.hpp>
+#include <dwango/cpu_features.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
+#include <dwango/tile_map.hpp>
+
+// Adds a layer with reflectance R2 and transmittance T2 behind a stack with
+// reflectance R1 and transmittance T1 (one channel).
+//
+// The reflectance of the stack seen from behind is taken to be R1, its
+// reflectance seen from the front, which is exact for a single layer only.
+// The step is therefore not associative: from the third layer on, combining
+// halves of a stack (adding-doubling) gives results that differ by up to a few
+// percent, so layers are added one at a time from the front.
+inline void add_behind(float& R1, float& T1, float R2, float T2) {
+  float const id = 1.0f / (1.0f - R1 * R2);
+
+  R1 = R1 + T1 * T1 * R2 * id;
+  T1 = T1 * T2 * id;
+}
+
+#if defined(DWANGO_AVX2_KERNELS)
+// add_behind() for the leading multiple of 8 pixels, 8 per iteration; the
+// division is replaced by the reciprocal approximation refined with one
+// Newton-Raphson step (relative error about 2^-22 instead of 2^-24). Returns
+// the number of pixels done.
+DWANGO_TARGET_AVX2 inline int add_behind_avx2(float* R1, float* T1,
+                                              float const* R2,
+                                              float const* T2, int count) {
+  int x = 0;
+  __m256 const one = _mm256_set1_ps(1.0f);
+  __m256 const two = _mm256_set1_ps(2.0f);
+  for (; x + 8 <= count; x += 8) {
+    __m256 const r1 = _mm256_loadu_ps(R1 + x);
+    __m256 const t1 = _mm256_loadu_ps(T1 + x);
+    __m256 const r2 = _mm256_loadu_ps(R2 + x);
+    __m256 const t2 = _mm256_loadu_ps(T2 + x);
+
+    __m256 const d = _mm256_sub_ps(one, _mm256_mul_ps(r1, r2));
+    __m256 id = _mm256_rcp_ps(d);
+    id = _mm256_mul_ps(id, _mm256_sub_ps(two, _mm256_mul_ps(d, id)));
+
+    __m256 const t1id = _mm256_mul_ps(t1, id);
+    __m256 const t1t1id = _mm256_mul_ps(t1, t1id);
+    _mm256_storeu_ps(R1 + x, _mm256_add_ps(r1, _mm256_mul_ps(t1t1id, r2)));
+    _mm256_storeu_ps(T1 + x, _mm256_mul_ps(t1id, t2));
+  }
+  return x;
+}
+#endif
+
+// add_behind() for count pixels of one channel stored as planes; on CPUs with
+// AVX2 see add_behind_avx2()
+inline void add_behind(float* R1, float* T1, float const* R2, float const* T2,
+                       int count) {
+  int x = 0;
+#if defined(DWANGO_AVX2_KERNELS)
+  if (dwango::cpu_features::instance().avx2) {
+    x = add_behind_avx2(R1, T1, R2, T2, count);
+  }
+#endif
+  for (; x < count; x++) {
+    add_behind(R1[x], T1[x], R2[x], T2[x]);
+  }
+}
 
 class MyFx : public tnzu::Fx {
  public:
@@ -91,84 +157,177 @@ int MyFx::kernel(Params const& params, Args const& args, cv::Mat& retimg) {
   float const gamma = params.get<float>(PARAM_GAMMA);
   float const exposure = params.get<float>(PARAM_EXPOSURE);
 
-  cv::Mat r(retimg.size(), CV_32FC3, cv::Scalar(0, 0, 0));
-  cv::Mat t(retimg.size(), CV_32FC3, cv::Scalar(1, 1, 1));
-
-  tnzu::linear_color_space_converter<sizeof(value_type) * 8> converter(exposure,
-                                                                       gamma);
+  auto const converter_table =
+      dwango::shared_linear_color_space_converter<sizeof(value_type) * 8>(
+          exposure, gamma);
+  auto const& converter = *converter_table;
   float const alpha_scale = 1.0f / std::numeric_limits<value_type>::max();
 
-  for (int i = args.count(); i-- > 0;) {
-    if (args.invalid(i)) {
-      continue;
-    }
+  auto const to_xyza = [&](Vec4T const& c) {
+    // linear sRGB (straight alpha)
+    cv::Vec3f const bgr(converter[c[0]],   // blue
+                        converter[c[1]],   // green
+                        converter[c[2]]);  // red
 
-    cv::Size const size = args.size(i);
+    // XYZ color space (D65)
+    cv::Vec3f const xyz = tnzu::to_xyz(bgr);
 
-    cv::Mat rlocal(r, args.rect(i));
-    cv::Mat tlocal(t, args.rect(i));
+    return cv::Vec4f(xyz[0], xyz[1], xyz[2], c[3] * alpha_scale);
+  };
 
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-    for (int y = 0; y < size.height; y++) {
-      Vec4T const* data = args.get(i).ptr<Vec4T const>(y);
-      cv::Vec3f* rdata = rlocal.ptr<cv::Vec3f>(y);
-      cv::Vec3f* tdata = tlocal.ptr<cv::Vec3f>(y);
-
-      for (int x = 0; x < size.width; x++) {
-        // linear sRGB (straight alpha)
-        cv::Vec3f const bgr(converter[data[x][0]],   // blue
-                            converter[data[x][1]],   // green
-                            converter[data[x][2]]);  // red
-        float const alpha = data[x][3] * alpha_scale;
-
-        // XYZ color space (D65)
-        cv::Vec3f const xyz = tnzu::to_xyz(bgr);
-
-        // Composite
-        for (int c = 0; c < 3; c++) {
-          float const R1 = rdata[x][c];
-          float const T1 = tdata[x][c];
-          float const R2 = xyz[c];
-          float const T2 = 1.0f - alpha;
-          float const id = 1.0f / (1.0f - R1 * R2);
-
-          rdata[x][c] = R1 + T1 * T1 * R2 * id;
-          tdata[x][c] = T1 * T2 * id;
-        }
-      }
+  auto const encoder_table =
+      dwango::shared_nonlinear_color_space_encoder<value_type>(exposure,
+                                                               gamma);
+  auto const& encoder = *encoder_table;
+
+  struct layer {
+    layer(cv::Mat const& image, cv::Rect const& rect)
+        : image(image), rect(rect), tiles(image) {}
+
+    cv::Mat image;
+    cv::Rect rect;
+    dwango::tile_map tiles;  // transparent tiles neither reflect nor absorb
+  };
+
+  // front-most layer first
+  std::vector<layer> layers;
+  for (int i = args.count(); i-- > 0;) {
+    if (args.valid(i)) {
+      layers.emplace_back(args.get(i), args.rect(i));
     }
   }
 
+  // tiles of retimg that any layer contributes to
+  dwango::tile_map used(retimg.size());
+  for (layer const& l : layers) {
+    used.merge(l.tiles, l.rect.tl());
+  }
+
+  // Layers are added behind the stack in front of them. Once the stack
+  // transmits less than half an output code in every channel, the layers
+  // behind it can change alpha by less than that and the color by T^2, so a
+  // pixel stops there; a tile stops when all of its pixels have.
+  float const opaque = 0.5f * alpha_scale;
+
+  int const tile = dwango::tile_map::tile_size;
   cv::Size const size = retimg.size();
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int y = 0; y < size.height; y++) {
-    Vec4T* data = retimg.ptr<Vec4T>(y);
-    cv::Vec3f const* rdata = r.ptr<cv::Vec3f const>(y);
-    cv::Vec3f const* tdata = t.ptr<cv::Vec3f const>(y);
-
-    for (int x = 0; x < size.width; x++) {
-      // XYZ color space: {X, Y, Z}
-      cv::Vec3f const xyz(rdata[x][0], rdata[x][1], rdata[x][2]);
-      float const alpha = 1.0f - tdata[x][1];
-
-      // linear RGB
-      cv::Vec3f const bgr = tnzu::to_bgr(xyz);
-
-      // sRGB (straight alpha)
-      cv::Vec4f const sbgra(
-          tnzu::to_nonlinear_color_space(bgr[0], exposure, gamma),
-          tnzu::to_nonlinear_color_space(bgr[1], exposure, gamma),
-          tnzu::to_nonlinear_color_space(bgr[2], exposure, gamma), alpha);
-
-      for (int c = 0; c < 4; c++) {
-        data[x][c] = tnzu::normalize_cast<value_type>(sbgra[c]);
+  dwango::parallel_for_blocks(0, size.height, [&](int y0, int y1) {
+    // cels repeat a few hundred colors
+    dwango::color_cache<cv::Vec4f> cache;
+
+    // reflectance and transmittance of the stack, one row, one plane per
+    // channel so that the recurrence vectorizes
+    std::vector<float> planes(6 * size.width);
+    float* r[3];
+    float* t[3];
+    for (int c = 0; c < 3; c++) {
+      r[c] = planes.data() + c * size.width;
+      t[c] = planes.data() + (3 + c) * size.width;
+    }
+    std::vector<cv::Vec4f> bgra(size.width);
+
+    auto const stopped = [&](int x) {
+      return (std::abs(t[0][x]) < opaque) && (std::abs(t[1][x]) < opaque) &&
+             (std::abs(t[2][x]) < opaque);
+    };
+
+    // one tile of a layer, as planes
+    float R2[3][tile];
+    float T2[tile];
+    bool skip[tile];
+
+    // pixels of each tile on the row that still see through the stack
+    std::vector<int> live(used.cols());
+
+    for (int y = y0; y < y1; y++) {
+      Vec4T* data = retimg.ptr<Vec4T>(y);
+
+      for (int tx = 0; tx < used.cols(); tx++) {
+        cv::Rect const rect = used.tile_rect(tx, y / tile);
+        live[tx] = used.occupied(tx, y / tile) ? rect.width : 0;
+      }
+      used.spans(y, [&](int x0, int x1, bool occupied) {
+        if (occupied) {
+          for (int c = 0; c < 3; c++) {
+            std::fill(r[c] + x0, r[c] + x1, 0.0f);
+            std::fill(t[c] + x0, t[c] + x1, 1.0f);
+          }
+        } else {
+          std::fill(data + x0, data + x1, Vec4T());
+        }
+      });
+
+      for (layer const& l : layers) {
+        int const ly = y - l.rect.y;
+        if ((ly < 0) || (ly >= l.rect.height)) {
+          continue;
+        }
+        cv::Mat const& image = l.image;
+        Vec4T const* src = image.ptr<Vec4T const>(ly);
+        int const offset = l.rect.x;
+
+        auto const composite = [&](int u0, int u1, bool occupied) {
+          if (!occupied) {
+            return;
+          }
+          int x = u0 + offset;
+          while (x < u1 + offset) {
+            int const tx = x / tile;
+            int const x1 = std::min((tx + 1) * tile, u1 + offset);
+            int const n = x1 - x;
+            if (!live[tx]) {
+              x = x1;
+              continue;
+            }
+
+            // stopped pixels get a clear layer, which leaves them as they are
+            for (int k = 0; k < n; k++) {
+              skip[k] = stopped(x + k);
+              cv::Vec4f const xyza =
+                  skip[k] ? cv::Vec4f(0, 0, 0, 0)
+                          : cache(src[x + k - offset], to_xyza);
+              R2[0][k] = xyza[0];
+              R2[1][k] = xyza[1];
+              R2[2][k] = xyza[2];
+              T2[k] = 1.0f - xyza[3];
+            }
+
+            // Composite
+            for (int c = 0; c < 3; c++) {
+              add_behind(r[c] + x, t[c] + x, R2[c], T2, n);
+            }
+
+            for (int k = 0; k < n; k++) {
+              if (!skip[k] && stopped(x + k)) {
+                --live[tx];
+              }
+            }
+            x = x1;
+          }
+        };
+        l.tiles.spans(ly, -offset, size.width - offset, composite);
       }
+
+      used.spans(y, [&](int x0, int x1, bool occupied) {
+        if (!occupied) {
+          return;
+        }
+        for (int x = x0; x < x1; x++) {
+          // XYZ color space: {X, Y, Z}
+          cv::Vec3f const xyz(r[0][x], r[1][x], r[2][x]);
+          float const alpha = 1.0f - t[1][x];
+
+          // linear RGB
+          cv::Vec3f const bgr = tnzu::to_bgr(xyz);
+
+          bgra[x] = cv::Vec4f(bgr[0], bgr[1], bgr[2], alpha);
+        }
+
+        // sRGB (straight alpha)
+        encoder(bgra.data() + x0, data + x0, x1 - x0);
+      });
     }
-  }
+  });
   return 0;
 }
 
@@ -181,5 +340,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(); }
 }
@@ -1,6 +1,9 @@
 #define TNZU_DEFINE_INTERFACE
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
+#include <dwango/tile_map.hpp>
 
 class MyFx : public tnzu::Fx {
  public:
@@ -86,11 +89,33 @@ int MyFx::kernel(Params const& params, Args const& args, cv::Mat& retimg) {
 
   args.get(PORT_INPUT).copyTo(retimg(args.rect(PORT_INPUT)));
 
-  retimg.forEach<Vec4T>([t](Vec4T& p, void const*) {
-    int const g = 299 * p[2] + 587 * p[1] + 114 * p[0];
-    if (g < t) {
-      p = Vec4T(0, 0, 0, 0);
-    }
+  auto const is_dark = [t](Vec4T const& p) {
+    return 299 * p[2] + 587 * p[1] + 114 * p[0] < t;
+  };
+
+  // transparent tiles stay transparent, flat tiles are decided by one pixel
+  dwango::tile_map const tiles(retimg);
+
+  cv::Size const size = retimg.size();
+  dwango::parallel_for(0, size.height, [&](int y) {
+    Vec4T* p = retimg.ptr<Vec4T>(y);
+
+    tiles.runs(y, [&](int x0, int x1, dwango::tile_map::state_type state) {
+      if (state == dwango::tile_map::empty) {
+        return;
+      }
+      if (state == dwango::tile_map::uniform) {
+        if (is_dark(p[x0])) {
+          std::fill(p + x0, p + x1, Vec4T(0, 0, 0, 0));
+        }
+        return;
+      }
+      for (int x = x0; x < x1; x++) {
+        if (is_dark(p[x])) {
+          p[x] = Vec4T(0, 0, 0, 0);
+        }
+      }
+    });
   });
   return 0;
 }
@@ -104,5 +129,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(); }
 }
@@ -1,6 +1,8 @@
 #define TNZU_DEFINE_INTERFACE
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
 
 struct plane_t {
   cv::Point3d n;
@@ -134,10 +136,7 @@ class MyFx : public tnzu::Fx {
 
     // generate kaleidoscope view
     DEBUG_PRINT("generate kaleidoscope view");
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-    for (int y = 0; y < size.height; ++y) {
+    dwango::parallel_for(0, size.height, [&](int y) {
       for (int x = 0; x < size.width; ++x) {
         // init view ray
         double rho = 1;
@@ -208,7 +207,7 @@ class MyFx : public tnzu::Fx {
           retimg.at<cv::Vec4w>(y, x) = data;
         }
       }
-    }
+    });
 
     return 0;
   } catch (cv::Exception const& e) {
@@ -225,5 +224,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(); }
 }
@@ -1,6 +1,10 @@
 #define TNZU_DEFINE_INTERFACE
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/color_space.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
+#include <dwango/tile_map.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
 class MyFx : public tnzu::Fx {
@@ -125,23 +129,29 @@ int MyFx::kernel(Params const& params, Args const& args, cv::Mat& retimg) {
   // transform color space
   DEBUG_PRINT("transform color space");
   {
-    tnzu::linear_color_space_converter<sizeof(value_type) * 8> converter(
-        exposure, gamma);
+    auto const converter_table =
+        dwango::shared_linear_color_space_converter<sizeof(value_type) * 8>(
+            exposure, gamma);
+    auto const& converter = *converter_table;
 
     cv::Size const local_size = args.size(PORT_INPUT);
     cv::Mat local(src, args.rect(PORT_INPUT));
 
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-    for (int y = 0; y < local_size.height; ++y) {
+    // flat tiles are converted once
+    dwango::tile_map const tiles(args.get(PORT_INPUT));
+
+    dwango::parallel_for(0, local_size.height, [&](int y) {
       Vec4T const* s = args.get(PORT_INPUT).ptr<Vec4T const>(y);
       cv::Vec3f* d = local.ptr<cv::Vec3f>(y);
-      for (int x = 0; x < local_size.width; ++x) {
-        d[x] = cv::Vec3f(converter[s[x][0]], converter[s[x][1]],
-                         converter[s[x][2]]);
-      }
-    }
+      tiles.runs(y, [&](int x0, int x1, dwango::tile_map::state_type state) {
+        int const n = (state == dwango::tile_map::mixed) ? x1 - x0 : 1;
+        for (int x = x0; x < x0 + n; ++x) {
+          d[x] = cv::Vec3f(converter[s[x][0]], converter[s[x][1]],
+                           converter[s[x][2]]);
+        }
+        std::fill(d + x0 + n, d + x1, d[x0]);
+      });
+    });
   }
 
   // generate glare kernel
@@ -176,24 +186,30 @@ int MyFx::kernel(Params const& params, Args const& args, cv::Mat& retimg) {
 
   // transform color space
   DEBUG_PRINT("transform color space");
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int y = 0; y < size.height; ++y) {
+  auto const encoder_table =
+      dwango::shared_nonlinear_color_space_encoder<value_type>(exposure,
+                                                               gamma);
+  auto const& encoder = *encoder_table;
+
+  // flat tiles are encoded once
+  dwango::tile_map const tiles(src);
+
+  dwango::parallel_for(0, size.height, [&](int y) {
     cv::Vec3f const* s = src.ptr<cv::Vec3f>(y);
     Vec4T* d = retimg.ptr<Vec4T>(y);
-    for (int x = 0; x < size.width; ++x) {
-      // sRGB (straight alpha)
-      cv::Vec4f const sbgra(
-          tnzu::to_nonlinear_color_space(s[x][0], exposure, gamma),
-          tnzu::to_nonlinear_color_space(s[x][1], exposure, gamma),
-          tnzu::to_nonlinear_color_space(s[x][2], exposure, gamma), 1.0f);
+    std::vector<cv::Vec4f> bgra(size.width);
 
-      for (int c = 0; c < 4; ++c) {
-        d[x][c] = tnzu::normalize_cast<value_type>(sbgra[c]);
+    tiles.runs(y, [&](int x0, int x1, dwango::tile_map::state_type state) {
+      int const n = (state == dwango::tile_map::mixed) ? x1 - x0 : 1;
+      for (int x = x0; x < x0 + n; ++x) {
+        bgra[x] = cv::Vec4f(s[x][0], s[x][1], s[x][2], 1.0f);
       }
-    }
-  }
+
+      // sRGB (straight alpha)
+      encoder(bgra.data() + x0, d + x0, n);
+      std::fill(d + x0 + n, d + x1, d[x0]);
+    });
+  });
 
   return 0;
 }
@@ -207,5 +223,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(); }
 }
@@ -1,6 +1,10 @@
 #define TNZU_DEFINE_INTERFACE
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/color_space.hpp>
+#include <dwango/gaussian_blur.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
 
 class MyFx : public tnzu::Fx {
  public:
@@ -328,17 +332,14 @@ int MyFx::kernel(Config const& config, Params const& params, Args const& args,
   }
 
   // blur bars
-  cv::GaussianBlur(light, light, cv::Size(blur, blur), 0.0);
+  dwango::gaussian_blur(light, light, blur);
 
   {
     float const dr = float(2 * M_PI) / 0.6850f;
     float const dg = float(2 * M_PI) / 0.5325f;
     float const db = float(2 * M_PI) / 0.4725f;
 
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-    for (int y = 0; y < size.height; y++) {
+    dwango::parallel_for(0, size.height, [&](int y) {
       float const* fld = field.ptr<float>(y);
       Vec4T const* msk = mask.ptr<Vec4T>(y);
       cv::Vec3f* dst = light.ptr<cv::Vec3f>(y);
@@ -359,37 +360,34 @@ int MyFx::kernel(Config const& config, Params const& params, Args const& args,
         dst[x][1] *= intensity * cg * msk[x][1];
         dst[x][2] *= intensity * cr * msk[x][2];
       }
-    }
+    });
   }
 
   // generate bloom
-  cv::GaussianBlur(light, light, cv::Size(blur, blur), 0.0);
+  dwango::gaussian_blur(light, light, blur);
   tnzu::generate_bloom(light, bloom);
 
   // init color table
-  tnzu::linear_color_space_converter<sizeof(value_type) * 8> converter(1.0f,
-                                                                       2.2f);
-
-// add incident light on linear color space
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int y = 0; y < size.height; y++) {
+  auto const converter_table =
+      dwango::shared_linear_color_space_converter<sizeof(value_type) * 8>(
+          1.0f, 2.2f);
+  auto const& converter = *converter_table;
+  auto const encoder_table =
+      dwango::shared_nonlinear_color_space_encoder<value_type>(1.0f, 2.2f);
+  auto const& encoder = *encoder_table;
+
+  // add incident light on linear color space
+  dwango::parallel_for(0, size.height, [&](int y) {
     cv::Vec3f const* s = light.ptr<cv::Vec3f>(y);
     Vec4T* d = retimg.ptr<Vec4T>(y);
+    std::vector<cv::Vec4f> bgra(size.width);
     for (int x = 0; x < size.width; x++) {
-      cv::Vec4f const sbgra(tnzu::to_nonlinear_color_space(
-                                converter[d[x][0]] + s[x][0], 1.0f, 2.2f),
-                            tnzu::to_nonlinear_color_space(
-                                converter[d[x][1]] + s[x][1], 1.0f, 2.2f),
-                            tnzu::to_nonlinear_color_space(
-                                converter[d[x][2]] + s[x][2], 1.0f, 2.2f),
-                            1.0f);
-      for (int c = 0; c < 4; ++c) {
-        d[x][c] = tnzu::normalize_cast<value_type>(sbgra[c]);
-      }
+      bgra[x] = cv::Vec4f(converter[d[x][0]] + s[x][0],
+                          converter[d[x][1]] + s[x][1],
+                          converter[d[x][2]] + s[x][2], 1.0f);
     }
-  }
+    encoder(bgra.data(), d, size.width);
+  });
 
   return 0;
 }
@@ -403,5 +401,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(dwango::depends_on_frame); }
 }
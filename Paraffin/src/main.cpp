@@ -1,6 +1,11 @@
 #define TNZU_DEFINE_INTERFACE
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/color_space.hpp>
+#include <dwango/gaussian_blur.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
+#include <dwango/tile_map.hpp>
 
 class MyFx : public tnzu::Fx {
  public:
@@ -129,7 +134,7 @@ class MyFx : public tnzu::Fx {
     }
 
     // blur bar
-    cv::GaussianBlur(shadow, shadow, cv::Size(s, s), 0.0);
+    dwango::gaussian_blur(shadow, shadow, s);
 
     if (retimg.type() == CV_8UC4) {
       return kernel<cv::Vec4b>(size, shadow, retimg);
@@ -146,29 +151,35 @@ int MyFx::kernel(cv::Size size, cv::Mat const& shadow, cv::Mat& retimg) {
   using value_type = typename Vec4T::value_type;
 
   // init color table
-  tnzu::linear_color_space_converter<sizeof(value_type) * 8> converter(1.0f,
-                                                                       2.2f);
-
-// add incident light on linear color space
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int y = 0; y < size.height; y++) {
+  auto const converter_table =
+      dwango::shared_linear_color_space_converter<sizeof(value_type) * 8>(
+          1.0f, 2.2f);
+  auto const& converter = *converter_table;
+  auto const encoder_table =
+      dwango::shared_nonlinear_color_space_encoder<value_type>(1.0f, 2.2f);
+  auto const& encoder = *encoder_table;
+
+  // flat tiles under a flat part of the shadow are shaded once
+  dwango::tile_map tiles(retimg);
+  tiles.intersect(dwango::tile_map(shadow));
+
+  // add incident light on linear color space
+  dwango::parallel_for(0, size.height, [&](int y) {
     cv::Vec3f const* s = shadow.ptr<cv::Vec3f>(y);
     Vec4T* d = retimg.ptr<Vec4T>(y);
-    for (int x = 0; x < size.width; x++) {
-      cv::Vec4f const sbgra(tnzu::to_nonlinear_color_space(
-                                converter[d[x][0]] * s[x][0], 1.0f, 2.2f),
-                            tnzu::to_nonlinear_color_space(
-                                converter[d[x][1]] * s[x][1], 1.0f, 2.2f),
-                            tnzu::to_nonlinear_color_space(
-                                converter[d[x][2]] * s[x][2], 1.0f, 2.2f),
-                            1.0f);
-      for (int c = 0; c < 4; ++c) {
-        d[x][c] = tnzu::normalize_cast<value_type>(sbgra[c]);
+    std::vector<cv::Vec4f> bgra(size.width);
+
+    tiles.runs(y, [&](int x0, int x1, dwango::tile_map::state_type state) {
+      int const n = (state == dwango::tile_map::mixed) ? x1 - x0 : 1;
+      for (int x = x0; x < x0 + n; x++) {
+        bgra[x] = cv::Vec4f(converter[d[x][0]] * s[x][0],
+                            converter[d[x][1]] * s[x][1],
+                            converter[d[x][2]] * s[x][2], 1.0f);
       }
-    }
-  }
+      encoder(bgra.data() + x0, d + x0, n);
+      std::fill(d + x0 + n, d + x1, d[x0]);
+    });
+  });
 }
 
 namespace tnzu {
@@ -180,5 +191,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(); }
 }
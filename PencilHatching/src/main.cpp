@@ -1,6 +1,8 @@
 #define TNZU_DEFINE_INTERFACE
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
 
 class MyFx : public tnzu::Fx {
  public:
@@ -129,10 +131,7 @@ int MyFx::kernel(Params const& params, Args const& args, cv::Mat& retimg) {
 
   // generate pencil drawings
   cv::Point2f const dir(std::cos(angle), std::sin(angle));
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int y = 0; y < size.height; ++y) {
+  dwango::parallel_for(0, size.height, [&](int y) {
     Vec4T const* src = color.ptr<Vec4T>(y);
     Vec4T* dst = retimg.ptr<Vec4T>(y);
 
@@ -175,7 +174,7 @@ int MyFx::kernel(Params const& params, Args const& args, cv::Mat& retimg) {
       value_type const g = cv::saturate_cast<value_type>(gray);
       dst[x] = Vec4T(g, g, g, src[x][3]);
     }
-  }
+  });
 }
 
 namespace tnzu {
@@ -187,5 +186,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(); }
 }
@@ -1,6 +1,10 @@
 #define TNZU_DEFINE_INTERFACE
 #include <toonz_utility.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/color_space.hpp>
+#include <dwango/gaussian_blur.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
 
 class MyFx : public tnzu::Fx {
  public:
@@ -111,7 +115,7 @@ class MyFx : public tnzu::Fx {
 
     // init input
     cv::Mat input = args.get(PORT_INPUT);
-    cv::GaussianBlur(input, input, cv::Size(blur, blur), 0.0);
+    dwango::gaussian_blur(input, input, blur);
 
     // init noise
     cv::Mat field = args.get(PORT_NOISE);
@@ -158,14 +162,16 @@ int MyFx::kernel(cv::Mat const& iimage, cv::Point2d ioffset,
   cv::Point3f const direction(0.0f, 0.0f, -1.0f);
 
   // init color table
-  tnzu::linear_color_space_converter<sizeof(value_type) * 8> converter(1.0f,
-                                                                       2.2f);
-
-// apply a wave glass
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int y = 0; y < size.height; ++y) {
+  auto const converter_table =
+      dwango::shared_linear_color_space_converter<sizeof(value_type) * 8>(
+          1.0f, 2.2f);
+  auto const& converter = *converter_table;
+  auto const encoder_table =
+      dwango::shared_nonlinear_color_space_encoder<value_type>(1.0f, 2.2f);
+  auto const& encoder = *encoder_table;
+
+  // apply a wave glass
+  dwango::parallel_for(0, size.height, [&](int y) {
     Vec4T* dst = retimg.ptr<Vec4T>(y);
 
     int const y0 = cv::borderInterpolate(y - 1, field.rows, cv::BORDER_WRAP);
@@ -217,8 +223,7 @@ int MyFx::kernel(cv::Mat const& iimage, cv::Point2d ioffset,
         for (int c = 0; c < 3; ++c) {
           float const value =
               converter[color[c]] * std::exp(-attenuation[c] * t);
-          color[c] = tnzu::normalize_cast<value_type>(
-              tnzu::to_nonlinear_color_space(value, 1.0f, 2.2f));
+          color[c] = encoder(value);
         }
         input = color;
       } else {
@@ -227,7 +232,7 @@ int MyFx::kernel(cv::Mat const& iimage, cv::Point2d ioffset,
 
       dst[x] = input;
     }
-  }
+  });
 
   return 0;
 }
@@ -241,5 +246,5 @@ PluginInfo const* plugin_info() {
   return &info;
 }
 
-Fx* make_fx() { return new MyFx(); }
+Fx* make_fx() { return new dwango::memoized<MyFx>(); }
 }
@@ -0,0 +1,322 @@
+// Stand-in for opentoonz_plugin_utility used by the headless benchmark.
+//
+// It provides the subset of the tnzu API the plugins in this repository use,
+// so that each plugin's main.cpp can be compiled into a standalone executable
+// and driven through MyFx::compute() without OpenToonz. The helpers follow
+// the utility library closely enough to keep the cost profile of each plugin
+// representative; they are not meant to be bit-exact.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#define TNZU_PP_STR_I(x) #x
+#define TNZU_PP_STR(x) TNZU_PP_STR_I(x)
+
+#ifndef DEBUG_PRINT
+#define DEBUG_PRINT(expr) \
+  do {                    \
+  } while (0)
+#endif
+
+namespace tnzu {
+
+//
+// plugin interface
+//
+class PluginInfo {
+ public:
+  PluginInfo(char const* name, char const* vendor, char const* note,
+             char const* helpurl)
+      : name(name), vendor(vendor), note(note), helpurl(helpurl) {}
+
+  char const* name;
+  char const* vendor;
+  char const* note;
+  char const* helpurl;
+};
+
+class Fx {
+ public:
+  struct ParamPrototype {
+    char const* name;
+    int group;
+    double defvalue;
+    double minvalue;
+    double maxvalue;
+  };
+
+  class Config {
+   public:
+    int frame = 0;
+  };
+
+  class Params {
+   public:
+    explicit Params(std::vector<double> values) : values_(std::move(values)) {}
+
+    int count() const { return static_cast<int>(values_.size()); }
+
+    template <typename T>
+    T get(int i) const {
+      return static_cast<T>(values_[i]);
+    }
+
+    template <typename T>
+    T get(int i, double scale) const {
+      return static_cast<T>(values_[i] * scale);
+    }
+
+    template <typename T>
+    T radian(int i) const {
+      return static_cast<T>(values_[i] * M_PI / 180);
+    }
+
+    template <typename T>
+    T seed(int i) const {
+      return static_cast<T>(values_[i] *
+                            std::numeric_limits<std::uint32_t>::max());
+    }
+
+    template <typename T>
+    std::mt19937_64 rng(int i) const {
+      return std::mt19937_64(seed<T>(i));
+    }
+
+   private:
+    std::vector<double> values_;
+  };
+
+  class Args {
+   public:
+    struct Port {
+      cv::Mat image;
+      cv::Point2d offset;
+    };
+
+    explicit Args(std::vector<Port> ports) : ports_(std::move(ports)) {}
+
+    int count() const { return static_cast<int>(ports_.size()); }
+    bool valid(int i) const { return !ports_[i].image.empty(); }
+    bool invalid(int i) const { return !valid(i); }
+    cv::Mat const& get(int i) const { return ports_[i].image; }
+    cv::Point2d offset(int i) const { return ports_[i].offset; }
+    cv::Size size(int i) const { return ports_[i].image.size(); }
+    cv::Rect rect(int i) const {
+      return cv::Rect(cv::Point(static_cast<int>(ports_[i].offset.x),
+                                static_cast<int>(ports_[i].offset.y)),
+                      size(i));
+    }
+
+   private:
+    std::vector<Port> ports_;
+  };
+
+ public:
+  virtual ~Fx() {}
+
+  virtual int port_count() const = 0;
+  virtual char const* port_name(int i) const = 0;
+
+  virtual int param_group_count() const = 0;
+  virtual char const* param_group_name(int i) const = 0;
+
+  virtual int param_count() const = 0;
+  virtual ParamPrototype const* param_prototype(int i) const = 0;
+
+  virtual int enlarge(Config const& config, Params const& params,
+                      cv::Rect2d& retrc) {
+    return 0;
+  }
+
+  virtual int compute(Config const& config, Params const& params,
+                      Args const& args, cv::Mat& retimg) = 0;
+};
+
+PluginInfo const* plugin_info();
+Fx* make_fx();
+
+//
+// math
+//
+template <typename T>
+inline T square(T x) {
+  return x * x;
+}
+
+template <typename T>
+inline T to_degree(T radian) {
+  return static_cast<T>(radian * 180 / M_PI);
+}
+
+template <typename T>
+inline cv::Rect_<T> make_infinite_rect() {
+  T const inf = std::numeric_limits<T>::max() / 4;
+  return cv::Rect_<T>(-inf, -inf, inf * 2, inf * 2);
+}
+
+inline cv::Point3d meet(cv::Point3d const& origin,
+                        cv::Point3d const& direction, double t) {
+  return origin + direction * t;
+}
+
+template <typename T>
+inline cv::Point3_<T> reflect(cv::Point3_<T> const& i,
+                              cv::Point3_<T> const& n) {
+  return i - n * (2 * n.dot(i));
+}
+
+template <typename T>
+inline cv::Point3_<T> refract(cv::Point3_<T> const& i, cv::Point3_<T> const& n,
+                              T eta) {
+  T const r = 1 / eta;
+  T const c = -n.dot(i);
+  T const k = 1 - r * r * (1 - c * c);
+  if (k < 0) {
+    return cv::Point3_<T>(0, 0, 0);
+  }
+  return i * r + n * (r * c - std::sqrt(k));
+}
+
+//
+// color
+//
+template <typename T>
+inline T normalize_cast(float value) {
+  return cv::saturate_cast<T>(value * std::numeric_limits<T>::max());
+}
+
+inline float to_gray(cv::Scalar const& bgr) {
+  return static_cast<float>(0.114 * bgr[0] + 0.587 * bgr[1] + 0.299 * bgr[2]);
+}
+
+inline cv::Vec3f to_xyz(cv::Vec3f const& bgr) {
+  return cv::Vec3f(0.4124f * bgr[2] + 0.3576f * bgr[1] + 0.1805f * bgr[0],
+                   0.2126f * bgr[2] + 0.7152f * bgr[1] + 0.0722f * bgr[0],
+                   0.0193f * bgr[2] + 0.1192f * bgr[1] + 0.9505f * bgr[0]);
+}
+
+inline cv::Vec3f to_bgr(cv::Vec3f const& xyz) {
+  return cv::Vec3f(0.0557f * xyz[0] - 0.2040f * xyz[1] + 1.0570f * xyz[2],
+                   -0.9689f * xyz[0] + 1.8758f * xyz[1] + 0.0415f * xyz[2],
+                   3.2406f * xyz[0] - 1.5372f * xyz[1] - 0.4986f * xyz[2]);
+}
+
+inline float to_linear_color_space(float value, float exposure, float gamma) {
+  return std::pow(std::max(value, 0.0f), gamma) * exposure;
+}
+
+inline float to_nonlinear_color_space(float value, float exposure,
+                                      float gamma) {
+  return std::pow(std::max(value / exposure, 0.0f), 1.0f / gamma);
+}
+
+template <int Bits>
+class linear_color_space_converter {
+ public:
+  linear_color_space_converter(float exposure, float gamma)
+      : table_(std::size_t(1) << Bits) {
+    float const scale = 1.0f / static_cast<float>(table_.size() - 1);
+    for (std::size_t i = 0; i < table_.size(); ++i) {
+      table_[i] = to_linear_color_space(i * scale, exposure, gamma);
+    }
+  }
+
+  float operator[](int i) const { return table_[i]; }
+
+ private:
+  std::vector<float> table_;
+};
+
+//
+// image
+//
+inline void draw_image(cv::Mat& dst, cv::Mat const& src,
+                       cv::Point2d const& offset) {
+  cv::Rect const drc(0, 0, dst.cols, dst.rows);
+  cv::Rect const src_rc(static_cast<int>(offset.x), static_cast<int>(offset.y),
+                        src.cols, src.rows);
+  cv::Rect const rc = drc & src_rc;
+  if (rc.area() <= 0) {
+    return;
+  }
+  src(cv::Rect(rc.x - src_rc.x, rc.y - src_rc.y, rc.width, rc.height))
+      .copyTo(dst(rc));
+}
+
+template <typename Vec4T>
+inline Vec4T tap_texel(cv::Mat const& src, cv::Point2d const& pos) {
+  int const x0 = std::min(std::max(static_cast<int>(pos.x), 0), src.cols - 1);
+  int const y0 = std::min(std::max(static_cast<int>(pos.y), 0), src.rows - 1);
+  int const x1 = std::min(x0 + 1, src.cols - 1);
+  int const y1 = std::min(y0 + 1, src.rows - 1);
+  float const fx = static_cast<float>(pos.x - x0);
+  float const fy = static_cast<float>(pos.y - y0);
+
+  Vec4T const& a = src.at<Vec4T>(y0, x0);
+  Vec4T const& b = src.at<Vec4T>(y0, x1);
+  Vec4T const& c = src.at<Vec4T>(y1, x0);
+  Vec4T const& d = src.at<Vec4T>(y1, x1);
+
+  Vec4T texel;
+  for (int i = 0; i < 4; ++i) {
+    float const top = a[i] + (b[i] - a[i]) * fx;
+    float const bottom = c[i] + (d[i] - c[i]) * fx;
+    texel[i] = cv::saturate_cast<typename Vec4T::value_type>(
+        top + (bottom - top) * fy);
+  }
+  return texel;
+}
+
+inline void generate_bloom(cv::Mat& img, int level, int radius = 1) {
+  cv::Mat acc = img.clone();
+  cv::Mat cur = img;
+  int const ksize = radius * 2 + 1;
+  for (int i = 0; i < level; ++i) {
+    if ((cur.cols < 2) || (cur.rows < 2)) {
+      break;
+    }
+    cv::Mat next;
+    cv::pyrDown(cur, next);
+    cv::GaussianBlur(next, next, cv::Size(ksize, ksize), 0.0);
+
+    cv::Mat up = next;
+    while (up.size() != img.size()) {
+      cv::Mat tmp;
+      cv::Size const s(std::min(up.cols * 2, img.cols),
+                       std::min(up.rows * 2, img.rows));
+      cv::resize(up, tmp, s, 0, 0, cv::INTER_LINEAR);
+      up = tmp;
+    }
+    acc += up;
+    cur = next;
+  }
+  img = acc;
+}
+
+template <typename T, std::size_t N>
+inline cv::Mat make_perlin_noise(cv::Size size, std::array<T, N> const& amp) {
+  cv::Mat field = cv::Mat::zeros(size, CV_32F);
+  cv::RNG& rng = cv::theRNG();
+  for (std::size_t i = 0; i < N; ++i) {
+    int const cells = 4 << i;
+    cv::Mat grid(std::max(size.height * cells / std::max(size.width, 1), 1) + 1,
+                 cells + 1, CV_32F);
+    rng.fill(grid, cv::RNG::UNIFORM, cv::Scalar(0), cv::Scalar(1));
+
+    cv::Mat octave;
+    cv::resize(grid, octave, size, 0, 0, cv::INTER_CUBIC);
+    field += octave * amp[i];
+  }
+  return field;
+}
+}
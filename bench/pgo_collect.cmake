@@ -0,0 +1,35 @@
+# Turns the profile of one benchmark executable into the profile of the
+# corresponding plugin (see pgo-train in CMakeLists.txt).
+#
+#   cmake -DPLUGIN=<name> -DBENCH_OBJECT_DIR=<dir> -DPLUGIN_OBJECT_DIR=<dir>
+#         -DPROFILE_DIR=<dir> [-DLLVM_PROFDATA=<path>] -P pgo_collect.cmake
+
+if(LLVM_PROFDATA)
+	# clang: merge the raw profiles; functions are matched by name
+	file(GLOB RAW_PROFILES "${PROFILE_DIR}/${PLUGIN}-*.profraw")
+	if(NOT RAW_PROFILES)
+		message(FATAL_ERROR "no profile for ${PLUGIN}")
+	endif()
+	execute_process(
+		COMMAND "${LLVM_PROFDATA}" merge -o "${PROFILE_DIR}/${PLUGIN}.profdata" ${RAW_PROFILES}
+		RESULT_VARIABLE RESULT)
+	if(RESULT)
+		message(FATAL_ERROR "llvm-profdata failed for ${PLUGIN}")
+	endif()
+else()
+	# gcc: profiles are named after the object file, so copy the one of the
+	# plugin source compiled into the benchmark next to the plugin's object
+	file(GLOB_RECURSE GCDA_FILES "${BENCH_OBJECT_DIR}/*.gcda")
+	set(GCDA)
+	foreach(FILE ${GCDA_FILES})
+		if(FILE MATCHES "/${PLUGIN}/src/main\\.cpp\\.gcda$")
+			set(GCDA "${FILE}")
+		endif()
+	endforeach()
+	if(NOT GCDA)
+		message(FATAL_ERROR "no profile for ${PLUGIN}")
+	endif()
+	file(MAKE_DIRECTORY "${PLUGIN_OBJECT_DIR}")
+	file(COPY "${GCDA}" DESTINATION "${PLUGIN_OBJECT_DIR}")
+	file(COPY "${GCDA}" DESTINATION "${PROFILE_DIR}/${PLUGIN}")
+endif()
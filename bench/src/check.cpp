@@ -0,0 +1,202 @@
+// Checks of the shared kernels in common/dwango against their reference
+// paths, run by ctest: the AVX2 paths against the scalar ones on the same
+// input, and approximations against OpenCV. Exits with 1 if any check fails.
+#include <toonz_utility.hpp>
+#include <dwango/color_space.hpp>
+#include <dwango/cpu_features.hpp>
+#include <dwango/disc_blur.hpp>
+#include <dwango/gaussian_blur.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void expect(bool ok, std::string const& what) {
+  std::cerr << (ok ? "ok    " : "FAIL  ") << what << std::endl;
+  if (!ok) {
+    ++failures;
+  }
+}
+
+// runs f once with the AVX2 kernels and once with the scalar ones
+template <typename F>
+void both_paths(F f) {
+  dwango::cpu_features& features = dwango::cpu_features::instance();
+  bool const avx2 = features.avx2;
+  f(true);
+  features.avx2 = false;
+  f(false);
+  features.avx2 = avx2;
+}
+
+// linear BGRA values covering the table, both ends, out-of-range values and
+// NaN
+std::vector<cv::Vec4f> make_linear_pixels(int count) {
+  cv::RNG rng(0x5eed);
+  std::vector<cv::Vec4f> pixels(count);
+  for (int i = 0; i < count; ++i) {
+    float const t = rng.uniform(-0.1f, 1.2f);
+    pixels[i] = cv::Vec4f(t, std::exp(-30.0f * rng.uniform(0.0f, 1.0f)),
+                          (i % 7 == 0) ? NAN : rng.uniform(0.0f, 1.0f),
+                          rng.uniform(-0.1f, 1.1f));
+  }
+  return pixels;
+}
+
+template <typename T>
+void check_encoder(float exposure, float gamma) {
+  dwango::nonlinear_color_space_encoder<T> const encoder(exposure, gamma);
+  int const count = 100003;  // not a multiple of the vector width
+  std::vector<cv::Vec4f> const src = make_linear_pixels(count);
+
+  std::vector<cv::Vec<T, 4>> dst[2];
+  both_paths([&](bool avx2) {
+    dst[avx2].resize(count);
+    encoder(src.data(), dst[avx2].data(), count);
+  });
+
+  int diff = 0;
+  int reference_diff = 0;
+  for (int i = 0; i < count; ++i) {
+    for (int c = 0; c < 4; ++c) {
+      diff = std::max(diff, std::abs(int(dst[0][i][c]) - int(dst[1][i][c])));
+    }
+    for (int c = 0; c < 3; ++c) {
+      int const reference = tnzu::normalize_cast<T>(
+          tnzu::to_nonlinear_color_space(src[i][c], exposure, gamma));
+      reference_diff =
+          std::max(reference_diff, std::abs(reference - int(dst[0][i][c])));
+    }
+  }
+  std::ostringstream what;
+  what << "nonlinear_color_space_encoder<" << sizeof(T) * 8 << "bit>("
+       << exposure << ", " << gamma << ") AVX2 vs scalar: " << diff
+       << ", vs tnzu::to_nonlinear_color_space: " << reference_diff;
+  expect((diff == 0) && (reference_diff <= 1), what.str());
+}
+
+template <typename T>
+void check_decoder(float exposure, float gamma) {
+  dwango::linear_color_space_decoder<T> const decoder(exposure, gamma);
+  int const count = 100003;
+  int const codes = std::numeric_limits<T>::max() + 1;
+  cv::RNG rng(0x5eed);
+  std::vector<cv::Vec<T, 4>> src(count);
+  for (int i = 0; i < count; ++i) {
+    for (int c = 0; c < 4; ++c) {
+      src[i][c] = static_cast<T>(rng.uniform(0, codes));
+    }
+  }
+
+  std::vector<cv::Vec4f> dst[2];
+  both_paths([&](bool avx2) {
+    dst[avx2].resize(count);
+    decoder(src.data(), dst[avx2].data(), count);
+  });
+
+  int mismatches = 0;
+  for (int i = 0; i < count; ++i) {
+    mismatches += (dst[0][i] != dst[1][i]);
+  }
+  std::ostringstream what;
+  what << "linear_color_space_decoder<" << sizeof(T) * 8 << "bit>("
+       << exposure << ", " << gamma << ") AVX2 vs scalar: " << mismatches
+       << " pixels differ";
+  expect(mismatches == 0, what.str());
+}
+
+// dwango::disc_blur against cv::filter2D with the dense kernel for the radii
+// on both sides of each switch of select_disc_blur_method() at this size
+void check_disc_blur(cv::Size size) {
+  cv::Mat src(size, CV_32F);
+  cv::randu(src, cv::Scalar(0.0), cv::Scalar(1.0));
+
+  std::vector<int> radii;
+  dwango::disc_blur_method last = dwango::disc_blur_method::direct;
+  for (int r = 1; r < std::min(size.width, size.height) / 2; ++r) {
+    dwango::disc_blur_method const method =
+        dwango::select_disc_blur_method(dwango::disc_kernel(r, 1.0f), size);
+    if (method != last) {
+      radii.push_back(r - 1);
+      radii.push_back(r);
+      last = method;
+    }
+  }
+
+  for (int r : radii) {
+    dwango::disc_kernel const kernel(
+        r, 1.0f / static_cast<float>(dwango::disc_kernel(r, 1.0f).area()));
+    cv::Mat fast;
+    cv::Mat reference;
+    dwango::disc_blur(src, fast, kernel);
+    cv::filter2D(src, reference, -1, kernel.dense());
+
+    double const error = cv::norm(fast, reference, cv::NORM_INF);
+    std::ostringstream what;
+    what << "disc_blur(radius " << r << ", "
+         << static_cast<int>(dwango::select_disc_blur_method(kernel, size))
+         << ") vs cv::filter2D at " << size.width << "x" << size.height
+         << ": " << error;
+    expect(error < 1e-4, what.str());
+  }
+}
+
+// dwango::gaussian_blur against cv::GaussianBlur for a kernel size whose
+// sigma (as derived by OpenCV) is about the given one. The image is a column
+// with an impulse on a constant background, so both filters run their
+// vertical pass only, and the impulse is far enough from the ends that the
+// border modes (replicated vs reflected) agree.
+void check_gaussian_blur(double sigma) {
+  int const half = static_cast<int>(std::lround((sigma - 0.8) / 0.3 + 1));
+  int const ksize = 2 * half + 1;
+  int const rows = 2 * ksize + 1;
+  float const background = 0.25f;
+
+  cv::Mat src(rows, 1, CV_32F, cv::Scalar(background));
+  src.at<float>(rows / 2) += 1.0f;
+
+  cv::Mat fast;
+  cv::Mat reference;
+  dwango::gaussian_blur(src, fast, ksize);
+  cv::GaussianBlur(src, reference, cv::Size(ksize, ksize), 0.0);
+
+  // the recursive filter is within about 3% of the peak of a Gaussian
+  double const peak = reference.at<float>(rows / 2) - background;
+  double const error = cv::norm(fast, reference, cv::NORM_INF) / peak;
+  std::ostringstream what;
+  what << "gaussian_blur(ksize " << ksize << ") vs cv::GaussianBlur: "
+       << error << " of the peak";
+  expect(error < 0.04, what.str());
+}
+}
+
+int main() {
+  if (!dwango::cpu_features::instance().avx2) {
+    std::cerr << "no AVX2 on this CPU, the AVX2 paths are not checked"
+              << std::endl;
+  }
+
+  check_encoder<uchar>(1.0f, 2.2f);
+  check_encoder<ushort>(1.0f, 2.2f);
+  check_encoder<ushort>(2.0f, 1.0f);
+  check_encoder<uchar>(0.5f, 0.5f);
+  check_decoder<uchar>(1.0f, 2.2f);
+  check_decoder<ushort>(1.0f, 2.2f);
+
+  for (double sigma : {20.0, 100.0, 300.0, 650.0}) {
+    check_gaussian_blur(sigma);
+  }
+
+  check_disc_blur(cv::Size(480, 270));
+
+  return failures ? 1 : 0;
+}
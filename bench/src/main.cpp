@@ -0,0 +1,462 @@
+// Headless benchmark for a single plugin.
+//
+// The plugin's main.cpp is linked into this executable against the stand-in
+// tnzu API in bench/include, so MyFx::compute() can be timed without
+// OpenToonz. Results are written as JSON.
+#include <toonz_utility.hpp>
+#include <dwango/cpu_features.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/result_cache.hpp>
+#include <dwango/tile_map.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct resolution_t {
+  char const* name;
+  cv::Size size;
+};
+
+std::array<resolution_t, 4> const resolutions = {
+    resolution_t{"1K", cv::Size(1024, 540)},
+    resolution_t{"2K", cv::Size(2048, 1080)},
+    resolution_t{"4K", cv::Size(4096, 2160)},
+    resolution_t{"8K", cv::Size(8192, 4320)},
+};
+
+struct options_t {
+  std::vector<std::string> resolutions = {"1K", "2K", "4K", "8K"};
+  std::vector<int> depths = {8, 16};
+  std::vector<int> threads;
+  std::string pattern = "cel";
+  int iterations = 5;
+  int warmup = 1;
+  int result_cache_mb = 0;
+  int check_scalar = -1;  // tolerance in codes; negative: time instead
+  std::string output;
+};
+
+std::vector<std::string> split(std::string const& s) {
+  std::vector<std::string> items;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+std::vector<int> split_int(std::string const& s) {
+  std::vector<int> items;
+  for (std::string const& item : split(s)) {
+    items.push_back(std::atoi(item.c_str()));
+  }
+  return items;
+}
+
+bool iequals(std::string const& a, std::string const& b) {
+  return (a.size() == b.size()) &&
+         std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+           return std::tolower(x) == std::tolower(y);
+         });
+}
+
+void usage(char const* argv0) {
+  std::cerr << "usage: " << argv0 << " [options]\n"
+            << "  --resolutions 1K,2K,4K,8K\n"
+            << "  --depths 8,16\n"
+            << "  --threads 1,2,4,...      (default: powers of two up to "
+               "hardware concurrency)\n"
+            << "  --pattern cel|dense      (synthetic frame content)\n"
+            << "  --iterations N           (timed calls per configuration)\n"
+            << "  --warmup N               (untimed calls per configuration)\n"
+            << "  --result-cache MB        (default: 0, repeated calls are "
+               "recomputed)\n"
+            << "  --output FILE            (default: stdout)\n"
+            << "  --check-scalar TOL       (instead of timing, compare the "
+               "AVX2 and scalar\n"
+            << "                            kernels; fails above TOL codes)\n";
+}
+
+std::vector<int> default_threads() {
+  int const n = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  std::vector<int> threads;
+  for (int t = 1; t < n; t *= 2) {
+    threads.push_back(t);
+  }
+  threads.push_back(n);
+  return threads;
+}
+
+void set_threads(int n) {
+  dwango::thread_pool::instance().set_budget(n);
+}
+
+//
+// synthetic inputs
+//
+
+// Mostly transparent frame with flat-color shapes and antialiased edges, which
+// is what character cels look like after ink and paint.
+cv::Mat make_cel(cv::Size size, int type) {
+  double const max_value = (type == CV_8UC4) ? 255 : 65535;
+  cv::Mat image(size, type, cv::Scalar(0, 0, 0, 0));
+
+  cv::RNG rng(0x5eed);
+  std::array<cv::Scalar, 6> const palette = {
+      cv::Scalar(0.20, 0.30, 0.90, 1.0), cv::Scalar(0.85, 0.80, 0.75, 1.0),
+      cv::Scalar(0.10, 0.10, 0.10, 1.0), cv::Scalar(0.60, 0.75, 0.95, 1.0),
+      cv::Scalar(0.30, 0.55, 0.25, 1.0), cv::Scalar(0.95, 0.95, 0.95, 1.0),
+  };
+  int const count = 24;
+  for (int i = 0; i < count; ++i) {
+    cv::Point2f const center(rng.uniform(0.2f, 0.8f) * size.width,
+                             rng.uniform(0.1f, 0.9f) * size.height);
+    cv::Size2f const axes(rng.uniform(0.02f, 0.12f) * size.height,
+                          rng.uniform(0.02f, 0.20f) * size.height);
+    cv::Scalar const color = palette[i % palette.size()] * max_value;
+    cv::ellipse(image, center, axes, rng.uniform(0.0, 180.0), 0, 360, color,
+                -1);
+  }
+  return image;
+}
+
+// Fully populated noisy frame; the worst case for content-dependent paths.
+cv::Mat make_dense(cv::Size size, int type) {
+  double const max_value = (type == CV_8UC4) ? 255 : 65535;
+  cv::Mat image(size, type);
+  cv::RNG rng(0x5eed);
+  rng.fill(image, cv::RNG::UNIFORM, cv::Scalar::all(0),
+           cv::Scalar::all(max_value + 1));
+  return image;
+}
+
+// Noise ports carry a float field packed into the pixel buffer.
+cv::Mat make_field(cv::Size size, int type) {
+  cv::Mat image(size, type);
+  cv::RNG rng(0xf1e1d);
+  std::size_t const count = size.width * image.elemSize() / sizeof(float);
+  for (int y = 0; y < size.height; ++y) {
+    float* p = image.ptr<float>(y);
+    for (std::size_t i = 0; i < count; ++i) {
+      p[i] = rng.uniform(0.0f, 1.0f);
+    }
+  }
+  return image;
+}
+
+// Small bokeh shape for kernel ports.
+cv::Mat make_shape(int type) {
+  double const max_value = (type == CV_8UC4) ? 255 : 65535;
+  cv::Mat image(cv::Size(65, 65), type, cv::Scalar(0, 0, 0, 0));
+  cv::circle(image, cv::Point(32, 32), 32, cv::Scalar::all(max_value), -1);
+  return image;
+}
+
+std::vector<tnzu::Fx::Args::Port> make_ports(tnzu::Fx const& fx,
+                                             cv::Size size, int type,
+                                             std::string const& pattern) {
+  cv::Mat const frame =
+      (pattern == "dense") ? make_dense(size, type) : make_cel(size, type);
+
+  std::vector<tnzu::Fx::Args::Port> ports(fx.port_count());
+  for (int i = 0; i < fx.port_count(); ++i) {
+    std::string const name = fx.port_name(i);
+    tnzu::Fx::Args::Port& port = ports[i];
+    if (iequals(name, "Noise")) {
+      port.image = make_field(size, type);
+    } else if (iequals(name, "A")) {
+      port.image = make_shape(type);
+    } else if (iequals(name, "B") || iequals(name, "C")) {
+      // leave unconnected
+    } else {
+      port.image = frame;
+    }
+  }
+  return ports;
+}
+
+tnzu::Fx::Params make_params(tnzu::Fx const& fx) {
+  std::vector<double> values(fx.param_count());
+  for (int i = 0; i < fx.param_count(); ++i) {
+    values[i] = fx.param_prototype(i)->defvalue;
+  }
+  return tnzu::Fx::Params(values);
+}
+
+//
+// measurement
+//
+struct result_t {
+  std::string resolution;
+  cv::Size size;
+  int depth;
+  int threads;
+  std::vector<double> latency;  // [ms]
+
+  // tile classification (dwango::tile_map), if the plugin uses it
+  std::uint64_t tiles = 0;
+  std::uint64_t empty_tiles = 0;
+  std::uint64_t uniform_tiles = 0;
+  std::vector<double> untiled_latency;  // [ms] with classification disabled
+};
+
+double median(std::vector<double> v) {
+  std::sort(v.begin(), v.end());
+  std::size_t const n = v.size();
+  return (n % 2) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) * 0.5;
+}
+
+double mean(std::vector<double> const& v) {
+  double sum = 0;
+  for (double x : v) {
+    sum += x;
+  }
+  return sum / v.size();
+}
+
+result_t run(tnzu::Fx& fx, resolution_t const& res, int depth, int threads,
+             options_t const& opts) {
+  int const type = (depth == 8) ? CV_8UC4 : CV_16UC4;
+
+  tnzu::Fx::Config config;
+  config.frame = 1;
+  tnzu::Fx::Params const params = make_params(fx);
+  tnzu::Fx::Args const args(make_ports(fx, res.size, type, opts.pattern));
+
+  set_threads(threads);
+
+  result_t result;
+  result.resolution = res.name;
+  result.size = res.size;
+  result.depth = depth;
+  result.threads = threads;
+
+  auto const measure = [&](std::vector<double>& latency) {
+    cv::Mat retimg(res.size, type);
+    for (int i = 0; i < opts.warmup + opts.iterations; ++i) {
+      retimg = cv::Scalar(0, 0, 0, 0);
+      auto const begin = std::chrono::steady_clock::now();
+      fx.compute(config, params, args, retimg);
+      auto const end = std::chrono::steady_clock::now();
+      if (i >= opts.warmup) {
+        latency.push_back(
+            std::chrono::duration<double, std::milli>(end - begin).count());
+      }
+    }
+  };
+
+  dwango::tile_statistics& stats = dwango::tile_statistics::instance();
+  stats.reset();
+  measure(result.latency);
+  result.tiles = stats.tiles;
+  result.empty_tiles = stats.empty;
+  result.uniform_tiles = stats.uniform;
+
+  // the same case again without the empty/uniform tile paths
+  if (result.tiles > 0) {
+    stats.disabled = true;
+    measure(result.untiled_latency);
+    stats.disabled = false;
+  }
+  return result;
+}
+
+// renders the case with the AVX2 kernels and again with the scalar ones, and
+// returns the largest difference of a channel in codes
+double compare_scalar(tnzu::Fx& fx, resolution_t const& res, int depth,
+                      options_t const& opts) {
+  int const type = (depth == 8) ? CV_8UC4 : CV_16UC4;
+
+  tnzu::Fx::Config config;
+  config.frame = 1;
+  tnzu::Fx::Params const params = make_params(fx);
+  tnzu::Fx::Args const args(make_ports(fx, res.size, type, opts.pattern));
+
+  dwango::cpu_features& features = dwango::cpu_features::instance();
+  bool const avx2 = features.avx2;
+  auto const render = [&](bool simd) {
+    features.avx2 = simd;
+    cv::Mat retimg(res.size, type, cv::Scalar(0, 0, 0, 0));
+    fx.compute(config, params, args, retimg);
+    return retimg;
+  };
+  cv::Mat const fast = render(avx2);
+  cv::Mat const scalar = render(false);
+  features.avx2 = avx2;
+  return cv::norm(fast, scalar, cv::NORM_INF);
+}
+
+void write_json(std::ostream& os, char const* plugin,
+                std::vector<result_t> const& results) {
+  os << "{\n";
+  os << "  \"plugin\": \"" << plugin << "\",\n";
+  os << "  \"hardware_concurrency\": " << std::thread::hardware_concurrency()
+     << ",\n";
+  os << "  \"results\": [";
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    result_t const& r = results[i];
+
+    // thread scaling is relative to the single-thread run of the same case
+    double base = 0;
+    for (result_t const& s : results) {
+      if ((s.resolution == r.resolution) && (s.depth == r.depth) &&
+          (s.threads == 1)) {
+        base = median(s.latency);
+      }
+    }
+
+    double const med = median(r.latency);
+    double const mpix = r.size.area() * 1e-6;
+    os << ((i == 0) ? "\n" : ",\n");
+    os << "    {";
+    os << "\"resolution\": \"" << r.resolution << "\", ";
+    os << "\"width\": " << r.size.width << ", ";
+    os << "\"height\": " << r.size.height << ", ";
+    os << "\"depth\": " << r.depth << ", ";
+    os << "\"threads\": " << r.threads << ", ";
+    os << "\"iterations\": " << r.latency.size() << ", ";
+    os << "\"latency_ms\": {";
+    os << "\"min\": " << *std::min_element(r.latency.begin(), r.latency.end())
+       << ", ";
+    os << "\"median\": " << med << ", ";
+    os << "\"mean\": " << mean(r.latency) << ", ";
+    os << "\"max\": " << *std::max_element(r.latency.begin(), r.latency.end());
+    os << "}, ";
+    os << "\"mpix_per_s\": " << ((med > 0) ? mpix / (med * 1e-3) : 0);
+    if (base > 0) {
+      os << ", \"speedup\": " << base / med;
+    }
+    if (r.tiles > 0) {
+      os << ", \"tiles\": {";
+      os << "\"classified\": " << r.tiles << ", ";
+      os << "\"empty\": " << r.empty_tiles << ", ";
+      os << "\"uniform\": " << r.uniform_tiles << ", ";
+      os << "\"hit_rate\": "
+         << double(r.empty_tiles + r.uniform_tiles) / r.tiles << ", ";
+      os << "\"speedup\": " << median(r.untiled_latency) / med;
+      os << "}";
+    }
+    os << "}";
+  }
+  os << "\n  ]\n";
+  os << "}\n";
+}
+}
+
+int main(int argc, char* argv[]) {
+  options_t opts;
+  for (int i = 1; i < argc; ++i) {
+    std::string const arg = argv[i];
+    if ((arg == "-h") || (arg == "--help")) {
+      usage(argv[0]);
+      return 0;
+    }
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    std::string const value = argv[++i];
+    if (arg == "--resolutions") {
+      opts.resolutions = split(value);
+    } else if (arg == "--depths") {
+      opts.depths = split_int(value);
+    } else if (arg == "--threads") {
+      opts.threads = split_int(value);
+    } else if (arg == "--pattern") {
+      opts.pattern = value;
+    } else if (arg == "--iterations") {
+      opts.iterations = std::max(1, std::atoi(value.c_str()));
+    } else if (arg == "--warmup") {
+      opts.warmup = std::max(0, std::atoi(value.c_str()));
+    } else if (arg == "--result-cache") {
+      opts.result_cache_mb = std::max(0, std::atoi(value.c_str()));
+    } else if (arg == "--check-scalar") {
+      opts.check_scalar = std::max(0, std::atoi(value.c_str()));
+    } else if (arg == "--output") {
+      opts.output = value;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (opts.threads.empty()) {
+    opts.threads = default_threads();
+  }
+
+  // every timed call repeats the same request
+  dwango::result_cache::instance().set_budget(std::size_t(opts.result_cache_mb)
+                                              << 20);
+
+  std::unique_ptr<tnzu::Fx> fx(tnzu::make_fx());
+  char const* const plugin = PLUGIN_NAME;
+
+  if (opts.check_scalar >= 0) {
+    if (!dwango::cpu_features::instance().avx2) {
+      std::cerr << plugin << ": no AVX2 on this CPU, nothing to compare"
+                << std::endl;
+      return 0;
+    }
+    // a single thread keeps the result independent of the schedule
+    set_threads(1);
+    bool ok = true;
+    for (resolution_t const& res : resolutions) {
+      if (std::find(opts.resolutions.begin(), opts.resolutions.end(),
+                    res.name) == opts.resolutions.end()) {
+        continue;
+      }
+      for (int depth : opts.depths) {
+        if ((depth != 8) && (depth != 16)) {
+          continue;
+        }
+        double const diff = compare_scalar(*fx, res, depth, opts);
+        std::cerr << plugin << ": " << res.name << " " << depth
+                  << "bit AVX2 vs scalar, max difference " << diff
+                  << std::endl;
+        ok = ok && (diff <= opts.check_scalar);
+      }
+    }
+    return ok ? 0 : 1;
+  }
+
+  std::vector<result_t> results;
+  for (resolution_t const& res : resolutions) {
+    if (std::find(opts.resolutions.begin(), opts.resolutions.end(),
+                  res.name) == opts.resolutions.end()) {
+      continue;
+    }
+    for (int depth : opts.depths) {
+      if ((depth != 8) && (depth != 16)) {
+        continue;
+      }
+      for (int threads : opts.threads) {
+        std::cerr << plugin << ": " << res.name << " " << depth << "bit "
+                  << threads << " thread(s)" << std::endl;
+        results.push_back(run(*fx, res, depth, threads, opts));
+      }
+    }
+  }
+
+  if (opts.output.empty()) {
+    write_json(std::cout, plugin, results);
+  } else {
+    std::ofstream ofs(opts.output);
+    write_json(ofs, plugin, results);
+  }
+  return 0;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace dwango {
+
+//
+// color_cache
+//
+// Small open-addressing table that memoizes a per-color transform of
+// cv::Vec4b / cv::Vec4w pixels. Cels are painted from a palette of a few
+// hundred colors, so most pixels repeat a color seen shortly before.
+//
+// The cache is not thread-safe; give each thread its own instance. It keeps
+// track of its hit rate and, once a window of lookups hits less than half of
+// the time (photographic or dithered input), bypasses itself and calls the
+// transform directly.
+template <typename Value, int Bits = 10>
+class color_cache {
+ public:
+  color_cache() : slots_(std::size_t(1) << Bits) {}
+
+  // f(color) for a cv::Vec4b or cv::Vec4w color
+  template <typename Vec4T, typename F>
+  Value operator()(Vec4T const& color, F const& f) {
+    if (bypass_) {
+      return f(color);
+    }
+
+    std::uint64_t key = 0;
+    std::memcpy(&key, &color, sizeof(color));
+    if (last_ && (last_->key == key)) {
+      count(true);
+      return last_->value;  // runs of the same color
+    }
+
+    std::size_t const mask = slots_.size() - 1;
+    std::size_t const home =
+        static_cast<std::size_t>((key * 0x9e3779b97f4a7c15ULL) >> (64 - Bits));
+    slot* free = nullptr;
+    for (std::size_t i = 0; i < probes; ++i) {
+      slot& s = slots_[(home + i) & mask];
+      if (!s.used) {
+        free = &s;  // nothing is ever removed, so the key is not further on
+        break;
+      }
+      if (s.key == key) {
+        count(true);
+        last_ = &s;
+        return s.value;
+      }
+    }
+
+    // miss: take a free slot in the probe window or evict the home slot
+    slot& s = free ? *free : slots_[home];
+    s.key = key;
+    s.value = f(color);
+    s.used = true;
+    count(false);
+    last_ = &s;
+    return s.value;
+  }
+
+  // false once the cache has switched itself off
+  bool active() const { return !bypass_; }
+
+ private:
+  static std::size_t const probes = 4;
+  static int const window = 4096;
+
+  struct slot {
+    std::uint64_t key = 0;
+    Value value;
+    bool used = false;
+  };
+
+  void count(bool hit) {
+    hits_ += hit ? 1 : 0;
+    if (++lookups_ < window) {
+      return;
+    }
+    bypass_ = hits_ * 2 < lookups_;
+    lookups_ = 0;
+    hits_ = 0;
+  }
+
+  std::vector<slot> slots_;
+  slot* last_ = nullptr;
+  int lookups_ = 0;
+  int hits_ = 0;
+  bool bypass_ = false;
+};
+}
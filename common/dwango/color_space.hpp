@@ -0,0 +1,396 @@
+#pragma once
+
+#include <toonz_utility.hpp>
+#include <dwango/cpu_features.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace dwango {
+
+namespace detail {
+
+inline std::uint32_t float_bits(float value) {
+  std::uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+// Process-wide cache of color tables constructed from (exposure, gamma).
+//
+// Building a 16-bit table costs tens of thousands of pow() calls, which used
+// to be paid by every compute() call. The most recently used tables are kept,
+// so animated parameters cannot grow the cache without bound.
+template <typename Table>
+class table_cache {
+ public:
+  using pointer = std::shared_ptr<Table const>;
+
+  static pointer get(float exposure, float gamma) {
+    std::uint64_t const key =
+        (std::uint64_t(float_bits(exposure)) << 32) | float_bits(gamma);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (pointer table = find(key)) {
+        return table;
+      }
+    }
+
+    // build outside of the lock; other keys stay available meanwhile
+    pointer table = std::make_shared<Table const>(exposure, gamma);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pointer other = find(key)) {
+      return other;  // built concurrently by another thread
+    }
+    entries_.emplace_front(key, table);
+    if (entries_.size() > capacity) {
+      entries_.pop_back();
+    }
+    return table;
+  }
+
+ private:
+  static std::size_t const capacity = 8;
+
+  // requires mutex_ to be held
+  static pointer find(std::uint64_t key) {
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (it->first == key) {
+        entries_.splice(entries_.begin(), entries_, it);  // most recent first
+        return it->second;
+      }
+    }
+    return pointer();
+  }
+
+  static std::mutex mutex_;
+  static std::list<std::pair<std::uint64_t, pointer>> entries_;
+};
+
+template <typename Table>
+std::mutex table_cache<Table>::mutex_;
+
+template <typename Table>
+std::list<std::pair<std::uint64_t, typename table_cache<Table>::pointer>>
+    table_cache<Table>::entries_;
+}
+
+//
+// nonlinear_color_space_encoder
+//
+// Table-driven replacement for
+//
+//   tnzu::normalize_cast<T>(tnzu::to_nonlinear_color_space(v, exposure, gamma))
+//
+// The table is indexed by the exponent and the top Mantissa bits of
+// t = v / exposure, i.e. it is uniform in log space. Its entries are values
+// of tnzu::to_nonlinear_color_space itself, linearly interpolated with the
+// remaining mantissa bits, so the interpolation is the only approximation.
+// When the table is built, that error is measured against the reference in
+// the middle of every segment; for a 16-bit output at gamma 2.2 it is about
+// 0.03 LSB. The encoder requires it to stay below 1/4 LSB, so results differ
+// from the scalar path by at most one code at rounding boundaries. Otherwise
+// (e.g. very small gamma) it falls back to the exact computation.
+//
+// Inputs below the table encode to 0 and inputs from t = 1 up to the maximum
+// code, which assumes that the curve is increasing; both ends are checked
+// against the reference as well.
+//
+// On CPUs with AVX2 the row encoder processes 8 BGRA pixels per iteration
+// with gathered table lookups (see cpu_features).
+template <typename T>
+class nonlinear_color_space_encoder {
+ public:
+  using value_type = T;
+  using pixel_type = cv::Vec<T, 4>;
+
+  nonlinear_color_space_encoder(float exposure, float gamma)
+      : exposure_(exposure),
+        gamma_(gamma),
+        inv_exposure_(1.0f / exposure),
+        max_code_(static_cast<float>(std::numeric_limits<T>::max())) {
+    // output codes of the reference for t = value / exposure
+    auto const reference = [this](float t) {
+      return tnzu::to_nonlinear_color_space(t * exposure_, exposure_,
+                                            gamma_) *
+             max_code_;
+    };
+    auto const entry_t = [this](std::size_t i) {
+      std::uint32_t const bits = static_cast<std::uint32_t>(base_ + i)
+                                 << (23 - Mantissa);
+      float t;
+      std::memcpy(&t, &bits, sizeof(t));
+      return t;
+    };
+
+    // below 2^-binades the output is less than 1/4 LSB
+    binades_ = 1;
+    while ((binades_ < 126) &&
+           !(reference(std::ldexp(1.0f, -binades_)) < 0.25f)) {
+      ++binades_;
+    }
+    base_ = static_cast<std::uint32_t>(127 - binades_) << Mantissa;
+    t_min_ = std::ldexp(1.0f, -binades_);
+
+    std::size_t const count = (std::size_t(binades_) << Mantissa) + 1;
+    std::vector<float> table(count);
+    for (std::size_t i = 0; i < count; ++i) {
+      table[i] = reference(entry_t(i));
+    }
+
+    error_bound_ = std::max<double>(reference(t_min_),
+                                    std::abs(max_code_ - reference(1.0f)));
+    for (std::size_t i = 0; i + 1 < count; ++i) {
+      float const t = 0.5f * (entry_t(i) + entry_t(i + 1));
+      double const interpolated = 0.5 * (double(table[i]) + table[i + 1]);
+      error_bound_ =
+          std::max(error_bound_, std::abs(reference(t) - interpolated));
+    }
+    if (error_bound_ <= 0.25) {
+      table_.swap(table);
+    }
+  }
+
+  // true if the table path is in use (see error_bound())
+  bool approximate() const { return !table_.empty(); }
+
+  // table error in LSB before rounding, as measured against the reference
+  double error_bound() const { return error_bound_; }
+
+  // encodes a single linear value
+  T operator()(float value) const {
+    if (!approximate()) {
+      return tnzu::normalize_cast<T>(
+          tnzu::to_nonlinear_color_space(value, exposure_, gamma_));
+    }
+    return cv::saturate_cast<T>(lookup(value * inv_exposure_));
+  }
+
+  // encodes count linear BGRA pixels (straight alpha, alpha in [0, 1])
+  void operator()(cv::Vec4f const* src, pixel_type* dst, int count) const {
+    int x = 0;
+#if defined(DWANGO_AVX2_KERNELS)
+    if (approximate() && cpu_features::instance().avx2) {
+      x = encode_avx2(src, dst, count);
+    }
+#endif
+    for (; x < count; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        dst[x][c] = (*this)(src[x][c]);
+      }
+      dst[x][3] = tnzu::normalize_cast<T>(src[x][3]);
+    }
+  }
+
+ private:
+  static int const Mantissa = 8;
+
+  // returns the output code (not yet rounded) for t = value / exposure
+  float lookup(float t) const {
+    if (!(t >= t_min_)) {
+      return 0.0f;  // also catches NaN
+    }
+    if (t >= 1.0f) {
+      return max_code_;
+    }
+    std::uint32_t const bits = detail::float_bits(t);
+    std::uint32_t const i = (bits >> (23 - Mantissa)) - base_;
+    float const frac = (bits & ((1u << (23 - Mantissa)) - 1)) *
+                       (1.0f / (1 << (23 - Mantissa)));
+    return table_[i] + (table_[i + 1] - table_[i]) * frac;
+  }
+
+#if defined(DWANGO_AVX2_KERNELS)
+  // codes for 2 BGRA pixels; alpha lanes are scaled linearly
+  DWANGO_TARGET_AVX2 __m256 encode8(__m256 v) const {
+    __m256 const t = _mm256_mul_ps(v, _mm256_set1_ps(inv_exposure_));
+    __m256i const bits = _mm256_castps_si256(t);
+
+    __m256i const last = _mm256_set1_epi32(static_cast<int>(table_.size() - 2));
+    __m256i i = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23 - Mantissa),
+                                 _mm256_set1_epi32(static_cast<int>(base_)));
+    i = _mm256_min_epi32(_mm256_max_epi32(i, _mm256_setzero_si256()), last);
+
+    __m256 const frac = _mm256_mul_ps(
+        _mm256_cvtepi32_ps(_mm256_and_si256(
+            bits, _mm256_set1_epi32((1 << (23 - Mantissa)) - 1))),
+        _mm256_set1_ps(1.0f / (1 << (23 - Mantissa))));
+    __m256 const y0 = _mm256_i32gather_ps(table_.data(), i, 4);
+    __m256 const y1 = _mm256_i32gather_ps(table_.data() + 1, i, 4);
+    __m256 y = _mm256_add_ps(y0, _mm256_mul_ps(_mm256_sub_ps(y1, y0), frac));
+
+    __m256 const max_code = _mm256_set1_ps(max_code_);
+    y = _mm256_and_ps(y, _mm256_cmp_ps(t, _mm256_set1_ps(t_min_), _CMP_GE_OQ));
+    y = _mm256_blendv_ps(y, max_code,
+                         _mm256_cmp_ps(t, _mm256_set1_ps(1.0f), _CMP_GE_OQ));
+
+    // alpha: clamp to [0, 1] and scale
+    __m256 const a = _mm256_mul_ps(
+        _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()),
+                      _mm256_set1_ps(1.0f)),
+        max_code);
+    return _mm256_blend_ps(y, a, 0x88);
+  }
+
+  DWANGO_TARGET_AVX2 int encode_avx2(cv::Vec4f const* src, pixel_type* dst,
+                                     int count) const {
+    float const* s = src[0].val;
+    int x = 0;
+    for (; x + 8 <= count; x += 8, s += 32) {
+      __m256i const q0 = _mm256_cvtps_epi32(encode8(_mm256_loadu_ps(s + 0)));
+      __m256i const q1 = _mm256_cvtps_epi32(encode8(_mm256_loadu_ps(s + 8)));
+      __m256i const q2 = _mm256_cvtps_epi32(encode8(_mm256_loadu_ps(s + 16)));
+      __m256i const q3 = _mm256_cvtps_epi32(encode8(_mm256_loadu_ps(s + 24)));
+
+      // packs work per 128-bit lane; restore the pixel order afterwards
+      __m256i const w01 =
+          _mm256_permute4x64_epi64(_mm256_packus_epi32(q0, q1), 0xd8);
+      __m256i const w23 =
+          _mm256_permute4x64_epi64(_mm256_packus_epi32(q2, q3), 0xd8);
+      store(dst + x, w01, w23);
+    }
+    return x;
+  }
+
+  DWANGO_TARGET_AVX2 static void store(cv::Vec<ushort, 4>* dst, __m256i w01,
+                                       __m256i w23) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst) + 0, w01);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst) + 1, w23);
+  }
+
+  DWANGO_TARGET_AVX2 static void store(cv::Vec<uchar, 4>* dst, __m256i w01,
+                                       __m256i w23) {
+    __m256i const b =
+        _mm256_permute4x64_epi64(_mm256_packus_epi16(w01, w23), 0xd8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), b);
+  }
+#endif
+
+  float exposure_;
+  float gamma_;
+  float inv_exposure_;
+  float max_code_;
+  double error_bound_;
+
+  int binades_ = 0;
+  std::uint32_t base_ = 0;
+  float t_min_ = 0.0f;
+  std::vector<float> table_;
+};
+
+//
+// linear_color_space_decoder
+//
+// Row-wise counterpart of tnzu::linear_color_space_converter: decodes BGRA
+// pixels to linear BGR with straight alpha scaled to [0, 1]. The table is
+// copied from the converter, so values are identical.
+//
+// On CPUs with AVX2 the row decoder processes 8 pixels per iteration with
+// gathered table lookups (see cpu_features).
+template <typename T>
+class linear_color_space_decoder {
+ public:
+  using value_type = T;
+  using pixel_type = cv::Vec<T, 4>;
+
+  linear_color_space_decoder(float exposure, float gamma)
+      : table_(std::size_t(std::numeric_limits<T>::max()) + 1),
+        alpha_scale_(1.0f / std::numeric_limits<T>::max()) {
+    tnzu::linear_color_space_converter<sizeof(T) * 8> const converter(exposure,
+                                                                      gamma);
+    for (std::size_t i = 0; i < table_.size(); ++i) {
+      table_[i] = converter[static_cast<int>(i)];
+    }
+  }
+
+  // decodes a single channel value
+  float operator[](int i) const { return table_[i]; }
+
+  // decodes a single pixel
+  cv::Vec4f operator()(pixel_type const& c) const {
+    return cv::Vec4f(table_[c[0]], table_[c[1]], table_[c[2]],
+                     c[3] * alpha_scale_);
+  }
+
+  // decodes count pixels
+  void operator()(pixel_type const* src, cv::Vec4f* dst, int count) const {
+    int x = 0;
+#if defined(DWANGO_AVX2_KERNELS)
+    if (cpu_features::instance().avx2) {
+      x = decode_avx2(src, dst, count);
+    }
+#endif
+    for (; x < count; ++x) {
+      dst[x] = (*this)(src[x]);
+    }
+  }
+
+ private:
+#if defined(DWANGO_AVX2_KERNELS)
+  // channel codes of 2 pixels
+  DWANGO_TARGET_AVX2 static __m256i load2(cv::Vec<uchar, 4> const* p) {
+    return _mm256_cvtepu8_epi32(
+        _mm_loadl_epi64(reinterpret_cast<__m128i const*>(p)));
+  }
+
+  DWANGO_TARGET_AVX2 static __m256i load2(cv::Vec<ushort, 4> const* p) {
+    return _mm256_cvtepu16_epi32(
+        _mm_loadu_si128(reinterpret_cast<__m128i const*>(p)));
+  }
+
+  DWANGO_TARGET_AVX2 int decode_avx2(pixel_type const* src, cv::Vec4f* dst,
+                                     int count) const {
+    __m256 const alpha_scale = _mm256_set1_ps(alpha_scale_);
+    float* d = dst[0].val;
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+      for (int k = x; k < x + 8; k += 2) {
+        __m256i const code = load2(src + k);
+        __m256 const v = _mm256_i32gather_ps(table_.data(), code, 4);
+        __m256 const a = _mm256_mul_ps(_mm256_cvtepi32_ps(code), alpha_scale);
+        _mm256_storeu_ps(d + k * 4, _mm256_blend_ps(v, a, 0x88));
+      }
+    }
+    return x;
+  }
+#endif
+
+  std::vector<float> table_;
+  float alpha_scale_;
+};
+
+// Returns a shared linear_color_space_converter for (exposure, gamma).
+// Keep the returned pointer alive while the table is in use.
+template <int Bits>
+std::shared_ptr<tnzu::linear_color_space_converter<Bits> const>
+shared_linear_color_space_converter(float exposure, float gamma) {
+  return detail::table_cache<tnzu::linear_color_space_converter<Bits>>::get(
+      exposure, gamma);
+}
+
+// Returns a shared nonlinear_color_space_encoder for (exposure, gamma).
+template <typename T>
+std::shared_ptr<nonlinear_color_space_encoder<T> const>
+shared_nonlinear_color_space_encoder(float exposure, float gamma) {
+  return detail::table_cache<nonlinear_color_space_encoder<T>>::get(exposure,
+                                                                     gamma);
+}
+
+// Returns a shared linear_color_space_decoder for (exposure, gamma).
+template <typename T>
+std::shared_ptr<linear_color_space_decoder<T> const>
+shared_linear_color_space_decoder(float exposure, float gamma) {
+  return detail::table_cache<linear_color_space_decoder<T>>::get(exposure,
+                                                                  gamma);
+}
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <dwango/singleton.hpp>
+
+#include <atomic>
+
+// AVX2 kernels are compiled in every x86 build, each function with its own
+// target attribute, and picked at run time. The rest of a plugin keeps the
+// baseline instruction set, so it still loads on CPUs without AVX2.
+//
+//   DWANGO_TARGET_AVX2 void f_avx2(...);
+//   ...
+//   if (dwango::cpu_features::instance().avx2) { f_avx2(...); }
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DWANGO_AVX2_KERNELS 1
+#define DWANGO_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+// MSVC compiles AVX2 intrinsics without /arch:AVX2
+#define DWANGO_AVX2_KERNELS 1
+#define DWANGO_TARGET_AVX2
+#endif
+
+namespace dwango {
+
+namespace detail {
+
+inline bool cpu_supports_avx2() {
+#if defined(DWANGO_AVX2_KERNELS) && defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+  // the OS must save the YMM registers (OSXSAVE, then XCR0 bits 1 and 2)
+  __cpuid(info, 1);
+  if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) ||
+      ((_xgetbv(0) & 6) != 6)) {
+    return false;
+  }
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#elif defined(DWANGO_AVX2_KERNELS)
+  // also checks that the OS saves the YMM registers
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") != 0;
+#else
+  return false;
+#endif
+}
+}
+
+//
+// cpu_features
+//
+// Instruction sets of the running CPU, detected when the plugin is loaded.
+// Clearing avx2 makes every kernel take its scalar path; the benchmark does
+// so to check both paths against each other.
+struct cpu_features {
+  cpu_features() : avx2(detail::cpu_supports_avx2()) {}
+
+  static cpu_features& instance() {
+    return detail::singleton<cpu_features>::instance;
+  }
+
+  std::atomic<bool> avx2;
+};
+}
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/parallel.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace dwango {
+
+//
+// disc_kernel
+//
+// A filled disc of the given radius as rasterized by cv::circle, with every
+// tap equal to weight. Since the disc is convex, each of its rows is a single
+// span [-half_width(dy), half_width(dy)].
+class disc_kernel {
+ public:
+  disc_kernel(int radius, float weight)
+      : radius_(std::max(radius, 0)),
+        weight_(weight),
+        half_widths_(2 * radius_ + 1, 0) {
+    if (radius_ == 0) {
+      return;
+    }
+    cv::Mat const taps = dense_taps();
+    for (int y = 0; y < taps.rows; ++y) {
+      unsigned char const* row = taps.ptr<unsigned char const>(y);
+      int w = -1;
+      for (int x = radius_; x < taps.cols; ++x) {
+        if (row[x]) {
+          w = x - radius_;
+        }
+      }
+      half_widths_[y] = w;
+    }
+  }
+
+  int radius() const { return radius_; }
+  float weight() const { return weight_; }
+
+  bool operator==(disc_kernel const& other) const {
+    return (radius_ == other.radius_) && (weight_ == other.weight_);
+  }
+
+  // -1 if row dy of the disc is empty
+  int half_width(int dy) const { return half_widths_[dy + radius_]; }
+
+  // number of taps
+  int area() const {
+    int n = 0;
+    for (int w : half_widths_) {
+      if (w >= 0) {
+        n += 2 * w + 1;
+      }
+    }
+    return n;
+  }
+
+  // the (2 radius + 1)^2 CV_32F kernel for cv::filter2D
+  cv::Mat dense() const {
+    if (radius_ == 0) {
+      return cv::Mat(1, 1, CV_32F, cv::Scalar(weight_));
+    }
+    cv::Mat kernel;
+    dense_taps().convertTo(kernel, CV_32F, weight_);
+    return kernel;
+  }
+
+ private:
+  cv::Mat dense_taps() const {
+    int const size = 2 * radius_ + 1;
+    cv::Mat taps = cv::Mat::zeros(cv::Size(size, size), CV_8U);
+    cv::circle(taps, cv::Point(radius_, radius_), radius_, cv::Scalar(1), -1);
+    return taps;
+  }
+
+  int radius_;
+  float weight_;
+  std::vector<int> half_widths_;
+};
+
+enum class disc_blur_method {
+  direct,  // cv::filter2D, small kernels
+  spans,   // row spans of prefix sums, O(radius) per pixel
+  dft,     // cv::filter2D, which switches to DFT for large kernels
+};
+
+// Picks a method for an image of the given size from rough costs per pixel:
+// the number of taps for direct convolution, two reads per row of the disc
+// for spans, and a constant times log2 of the area for the transforms of the
+// DFT path. These are heuristics, not measured timings; with these constants
+// a whole frame switches from spans to the DFT at a radius of 139 at 4K and
+// 128 at 2K. All methods give the same result up to rounding (check_kernels
+// compares them with cv::filter2D on both sides of each switch), so the
+// choice only affects speed.
+//
+// rows is the number of output rows wanted out of size.height (all of them by
+// default). cv::filter2D computes every row, so its costs are scaled up.
+inline disc_blur_method select_disc_blur_method(disc_kernel const& kernel,
+                                                cv::Size size, int rows = -1) {
+  double const r = kernel.radius();
+  double const waste =
+      (rows > 0) ? static_cast<double>(size.height) / rows : 1.0;
+  double const direct = kernel.area() * waste;
+  double const spans = 2 * (2 * r + 1) + 2;
+  double const dft =
+      24 * waste *
+      std::log2(std::max((size.width + 2 * r) * (size.height + 2 * r), 2.0));
+  if (direct <= spans) {
+    return disc_blur_method::direct;
+  }
+  return (spans <= dft) ? disc_blur_method::spans : disc_blur_method::dft;
+}
+
+namespace detail {
+
+// row y of src with BORDER_REFLECT_101 applied horizontally, as prefix sums:
+// p[i] = sum of the padded row up to, not including, i - pad
+inline void disc_blur_prefix(cv::Mat const& src, int y, int pad, double* p) {
+  float const* s = src.ptr<float const>(y);
+  int const n = src.cols + 2 * pad;
+  double sum = 0;
+  p[0] = 0;
+  for (int i = 0; i < n; ++i) {
+    int x = i - pad;
+    if ((x < 0) || (x >= src.cols)) {
+      x = cv::borderInterpolate(x, src.cols, cv::BORDER_REFLECT_101);
+    }
+    sum += s[x];
+    p[i + 1] = sum;
+  }
+}
+
+// output row of the disc blur from the prefix sums of the rows y - r ... y + r
+// of the source (rows[dy + r]), padded by pad >= r
+inline void disc_blur_row(disc_kernel const& kernel, int pad,
+                          double const* const* rows, int width, double* sum,
+                          float* dst) {
+  int const r = kernel.radius();
+  std::fill(sum, sum + width, 0.0);
+  for (int dy = -r; dy <= r; ++dy) {
+    int const w = kernel.half_width(dy);
+    if (w < 0) {
+      continue;
+    }
+    double const* hi = rows[dy + r] + pad + w + 1;
+    double const* lo = rows[dy + r] + pad - w;
+    for (int x = 0; x < width; ++x) {
+      sum[x] += hi[x] - lo[x];
+    }
+  }
+  for (int x = 0; x < width; ++x) {
+    dst[x] = static_cast<float>(sum[x] * kernel.weight());
+  }
+}
+}
+
+// One blur of disc_blur(): src[source] blurred with kernel.
+struct disc_blur_pass {
+  int source;
+  disc_kernel kernel;
+
+  bool operator==(disc_blur_pass const& other) const {
+    return (source == other.source) && (kernel == other.kernel);
+  }
+};
+
+// Buffers of disc_blur() that a caller blurring several bands of an image
+// keeps across calls, so they are allocated once.
+struct disc_blur_workspace {
+  std::vector<double> prefix;
+};
+
+// Runs several blurs of images of the same size at once: dst[i] is
+// src[passes[i].source] blurred with passes[i].kernel, as by the single
+// kernel overload below. Equal passes are run once and their results share
+// data.
+//
+// The sources are handled one after another. The passes of a source are
+// split into tiles of rows times passes and scheduled as one loop on the
+// shared pool, so that every thread stays busy even for a few passes. Span
+// passes share the prefix sums of their source, which the workspace holds
+// for one source at a time, and direct passes run cv::filter2D on a tile,
+// reading the rows around it from src. DFT passes are run whole, one per
+// thread, as OpenCV itself runs on one thread inside the pool.
+inline void disc_blur(std::vector<cv::Mat> const& src,
+                      std::vector<disc_blur_pass> const& passes,
+                      std::vector<cv::Mat>& dst, cv::Range range,
+                      disc_blur_workspace& workspace) {
+  dst.assign(passes.size(), cv::Mat());
+  if (src.empty()) {
+    return;
+  }
+  cv::Size const size = src[0].size();
+  if (range == cv::Range::all()) {
+    range = cv::Range(0, size.height);
+  }
+
+  std::vector<int> whole;
+  std::vector<std::vector<int>> tiled(src.size());
+  std::vector<disc_blur_method> methods(passes.size());
+  std::vector<cv::Mat> dense(passes.size());
+  for (std::size_t i = 0; i < passes.size(); ++i) {
+    disc_blur_pass const& pass = passes[i];
+    if (std::find(passes.begin(), passes.begin() + i, pass) !=
+        passes.begin() + i) {
+      continue;  // a duplicate
+    }
+    methods[i] = select_disc_blur_method(pass.kernel, size, range.size());
+    if (methods[i] == disc_blur_method::dft) {
+      whole.push_back(static_cast<int>(i));
+      continue;
+    }
+    dst[i].create(range.size(), size.width, CV_32F);
+    if (methods[i] == disc_blur_method::direct) {
+      dense[i] = pass.kernel.dense();
+    }
+    tiled[pass.source].push_back(static_cast<int>(i));
+  }
+
+  dwango::parallel_for(0, static_cast<int>(whole.size()), [&](int w) {
+    int const i = whole[w];
+    cv::Mat blurred;
+    cv::filter2D(src[passes[i].source], blurred, -1, passes[i].kernel.dense());
+    dst[i] = blurred.rowRange(range);
+  });
+
+  int const tile_rows = 4;
+  int const tiles = (range.size() + tile_rows - 1) / tile_rows;
+  for (std::size_t s = 0; s < src.size(); ++s) {
+    std::vector<int> const& group = tiled[s];
+    int const count = static_cast<int>(group.size());
+    if (!count) {
+      continue;
+    }
+
+    // prefix sums in double: the difference of two large sums must keep the
+    // precision of dark pixels
+    int pad = -1;
+    for (int i : group) {
+      if (methods[i] == disc_blur_method::spans) {
+        pad = std::max(pad, passes[i].kernel.radius());
+      }
+    }
+    int const stride = size.width + 2 * pad + 1;
+    if (pad >= 0) {
+      workspace.prefix.resize(std::size_t(size.height) * stride);
+      dwango::parallel_for(0, size.height, [&](int y) {
+        detail::disc_blur_prefix(src[s], y, pad,
+                                 &workspace.prefix[std::size_t(y) * stride]);
+      });
+    }
+
+    dwango::parallel_for_blocks(0, tiles * count, [&](int b, int e) {
+      std::vector<double const*> rows;
+      std::vector<double> sum(size.width);
+      for (int t = b; t < e; ++t) {
+        int const i = group[t % count];
+        int const y0 = range.start + (t / count) * tile_rows;
+        int const y1 = std::min(y0 + tile_rows, range.end);
+        disc_blur_pass const& pass = passes[i];
+
+        if (methods[i] == disc_blur_method::direct) {
+          cv::Mat tile = dst[i].rowRange(y0 - range.start, y1 - range.start);
+          cv::filter2D(src[s].rowRange(y0, y1), tile, -1, dense[i]);
+          continue;
+        }
+
+        int const r = pass.kernel.radius();
+        rows.resize(2 * r + 1);
+        for (int y = y0; y < y1; ++y) {
+          for (int dy = -r; dy <= r; ++dy) {
+            int const sy = cv::borderInterpolate(y + dy, size.height,
+                                                 cv::BORDER_REFLECT_101);
+            rows[dy + r] = &workspace.prefix[std::size_t(sy) * stride];
+          }
+          detail::disc_blur_row(pass.kernel, pad, rows.data(), size.width,
+                                sum.data(),
+                                dst[i].ptr<float>(y - range.start));
+        }
+      }
+    });
+  }
+
+  for (std::size_t i = 0; i < passes.size(); ++i) {
+    auto const first = std::find(passes.begin(), passes.end(), passes[i]);
+    dst[i] = dst[first - passes.begin()];
+  }
+}
+
+inline void disc_blur(std::vector<cv::Mat> const& src,
+                      std::vector<disc_blur_pass> const& passes,
+                      std::vector<cv::Mat>& dst,
+                      cv::Range range = cv::Range::all()) {
+  disc_blur_workspace workspace;
+  disc_blur(src, passes, dst, range, workspace);
+}
+
+// Same as cv::filter2D(src, dst, -1, kernel.dense()) for a CV_32F image with
+// the default border (BORDER_REFLECT_101), up to rounding. The method is
+// chosen by select_disc_blur_method().
+//
+// Only the rows of src in range are written to dst. A band of an image can
+// be blurred by passing the band with kernel.radius() extra rows above and
+// below and the range of the band proper.
+inline void disc_blur(cv::Mat const& src, cv::Mat& dst,
+                      disc_kernel const& kernel,
+                      cv::Range range = cv::Range::all()) {
+  std::vector<cv::Mat> blurred;
+  disc_blur({src}, {disc_blur_pass{0, kernel}}, blurred, range);
+  dst = blurred[0];
+}
+
+// Blurs the same image with several discs: dst[i] is src blurred with
+// kernels[i].
+inline void disc_blur(cv::Mat const& src,
+                      std::vector<disc_kernel> const& kernels,
+                      std::vector<cv::Mat>& dst,
+                      cv::Range range = cv::Range::all()) {
+  std::vector<disc_blur_pass> passes;
+  for (disc_kernel const& kernel : kernels) {
+    passes.push_back(disc_blur_pass{0, kernel});
+  }
+  disc_blur({src}, passes, dst, range);
+}
+}
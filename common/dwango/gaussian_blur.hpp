@@ -0,0 +1,139 @@
+#pragma once
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <dwango/parallel.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+namespace dwango {
+
+// Kernels with a smaller radius are left to cv::GaussianBlur.
+int const gaussian_blur_crossover_radius = 16;
+
+namespace detail {
+
+// Young and van Vliet, "Recursive implementation of the Gaussian filter",
+// Signal Processing 44 (1995). Third order causal + anti-causal IIR filter
+// whose cost per pixel does not depend on sigma (valid for sigma >= 0.5). Its
+// impulse response stays within about 3% of the peak of a sampled Gaussian.
+//
+// The filter has a near-triple pole at 1 - 1/q and a DC gain of order
+// 1/sigma^3, so small coefficient errors change its shape at large sigma.
+// The coefficients are therefore derived in double from the poles m0 and
+// m1 +- i m2 of the paper; its decimal constants are these polynomials times
+// 0.422205, rounded, which is off by far more than (1/q)^3 at q ~ 600. B is
+// exact as well, so the DC gain is one.
+struct recursive_gaussian_coefficients {
+  explicit recursive_gaussian_coefficients(double sigma) {
+    double const q = (sigma >= 2.5)
+                         ? 0.98711 * sigma - 0.96330
+                         : 3.97156 - 4.14554 * std::sqrt(1 - 0.26891 * sigma);
+    double const q2 = q * q;
+    double const q3 = q2 * q;
+
+    double const m0 = 1.16680;
+    double const m1 = 1.10783;
+    double const m2 = 1.40586;
+    double const mm = m1 * m1 + m2 * m2;
+    double const b0 = (m0 + q) * (mm + 2 * m1 * q + q2);
+
+    b1 = q * (2 * m0 * m1 + mm + (2 * m0 + 4 * m1) * q + 3 * q2) / b0;
+    b2 = -q2 * (m0 + 2 * m1 + 3 * q) / b0;
+    b3 = q3 / b0;
+    B = m0 * mm / b0;
+  }
+
+  double B;
+  double b1;
+  double b2;
+  double b3;
+};
+
+// Filters floats [x0, x1) of every row along the vertical direction, in place.
+// The inner loops run across columns, so they vectorize.
+//
+// The last three outputs are kept in double, since they are fed back with a
+// gain of about 1/B; only the values stored back into m are rounded to float.
+//
+// The border is extended by replication: starting both passes from their
+// steady state makes the first output row equal to the input row.
+inline void recursive_gaussian_columns(cv::Mat& m, int x0, int x1,
+                                       recursive_gaussian_coefficients const& k) {
+  int const rows = m.rows;
+  int const n = x1 - x0;
+  std::vector<double> state(3 * n);
+
+  // y1, y2 and y3 are the outputs of the previous three rows; each step
+  // overwrites the oldest one and rotates the pointers
+  auto const pass = [&](int first, int step) {
+    double* y1 = &state[0];
+    double* y2 = &state[n];
+    double* y3 = &state[2 * n];
+    float const* p0 = m.ptr<float>(first) + x0;
+    for (int i = 0; i < n; ++i) {
+      y1[i] = y2[i] = y3[i] = p0[i];
+    }
+    for (int y = first + step; (y >= 0) && (y < rows); y += step) {
+      float* p = m.ptr<float>(y) + x0;
+      for (int i = 0; i < n; ++i) {
+        double const v = k.B * p[i] + k.b1 * y1[i] + k.b2 * y2[i] +
+                         k.b3 * y3[i];
+        y3[i] = v;
+        p[i] = static_cast<float>(v);
+      }
+      std::swap(y2, y3);
+      std::swap(y1, y2);
+    }
+  };
+
+  pass(0, 1);          // causal
+  pass(rows - 1, -1);  // anti-causal
+}
+
+// Filters a CV_32F matrix (any channel count) vertically, in place, split into
+// column strips that are processed in parallel.
+inline void recursive_gaussian_vertical(
+    cv::Mat& m, recursive_gaussian_coefficients const& k) {
+  int const width = m.cols * m.channels();
+  int const strip = 64;
+  int const count = (width + strip - 1) / strip;
+
+  dwango::parallel_for(0, count, [&](int i) {
+    recursive_gaussian_columns(m, i * strip, std::min((i + 1) * strip, width),
+                               k);
+  });
+}
+}
+
+// Drop-in for cv::GaussianBlur(src, dst, cv::Size(ksize, ksize), 0.0).
+//
+// sigma is derived from ksize as OpenCV does. Above the crossover radius the
+// image is filtered with a recursive Gaussian instead, whose cost does not
+// depend on the kernel size. The horizontal pass runs on the transposed image
+// so that both passes vectorize across pixels. Unlike cv::GaussianBlur the
+// border is replicated instead of reflected, which only affects the outermost
+// sigma pixels. src and dst may be the same matrix.
+inline void gaussian_blur(cv::Mat const& src, cv::Mat& dst, int ksize) {
+  if (src.empty() || (ksize / 2 < gaussian_blur_crossover_radius)) {
+    cv::GaussianBlur(src, dst, cv::Size(ksize, ksize), 0.0);
+    return;
+  }
+
+  double const sigma = 0.3 * ((ksize - 1) * 0.5 - 1) + 0.8;
+  detail::recursive_gaussian_coefficients const k(sigma);
+
+  cv::Mat buf;
+  src.convertTo(buf, CV_32F);
+  detail::recursive_gaussian_vertical(buf, k);
+
+  cv::Mat transposed;
+  cv::transpose(buf, transposed);
+  detail::recursive_gaussian_vertical(transposed, k);
+  cv::transpose(transposed, buf);
+
+  buf.convertTo(dst, src.type());
+}
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+#include <algorithm>
+#include <vector>
+
+namespace dwango {
+
+//
+// layer_coverage
+//
+// Arrangement of the rectangles of several layers on an image. The image is
+// cut into horizontal bands at the top and bottom edges of the rectangles and
+// each band into segments at their left and right edges, so that every
+// segment is covered by a fixed set of layers. Compositing then only needs to
+// blend where two or more layers overlap.
+class layer_coverage {
+ public:
+  layer_coverage(cv::Size size, std::vector<cv::Rect> const& rects)
+      : size_(size) {
+    cv::Rect const image(cv::Point(0, 0), size);
+
+    std::vector<cv::Rect> clipped;
+    for (cv::Rect const& rect : rects) {
+      clipped.push_back(rect & image);
+    }
+
+    std::vector<int> ys = {0, size.height};
+    for (cv::Rect const& rect : clipped) {
+      if (rect.area() > 0) {
+        ys.push_back(rect.y);
+        ys.push_back(rect.y + rect.height);
+      }
+    }
+    std::sort(ys.begin(), ys.end());
+    ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+
+    for (std::size_t b = 0; b + 1 < ys.size(); ++b) {
+      int const y = ys[b];
+      band_y_.push_back(y);
+      band_first_.push_back(static_cast<int>(segments_.size()));
+
+      std::vector<int> xs = {0, size.width};
+      for (cv::Rect const& rect : clipped) {
+        if (covers_row(rect, y)) {
+          xs.push_back(rect.x);
+          xs.push_back(rect.x + rect.width);
+        }
+      }
+      std::sort(xs.begin(), xs.end());
+      xs.erase(std::unique(xs.begin(), xs.end()), xs.end());
+
+      for (std::size_t s = 0; s + 1 < xs.size(); ++s) {
+        segment seg = {xs[s], xs[s + 1], static_cast<int>(layers_.size()), 0};
+        for (std::size_t i = 0; i < clipped.size(); ++i) {
+          cv::Rect const& rect = clipped[i];
+          if (covers_row(rect, y) && (rect.x <= seg.x0) &&
+              (seg.x0 < rect.x + rect.width)) {
+            layers_.push_back(static_cast<int>(i));
+            ++seg.count;
+          }
+        }
+        segments_.push_back(seg);
+      }
+    }
+    band_first_.push_back(static_cast<int>(segments_.size()));
+  }
+
+  // calls f(x0, x1, layers, count) for the segments of row y from left to
+  // right, where layers[0] ... layers[count - 1] are the indices of the
+  // rectangles covering [x0, x1), in ascending order
+  template <typename F>
+  void segments(int y, F f) const {
+    if ((y < 0) || (y >= size_.height)) {
+      return;
+    }
+    int const b = static_cast<int>(
+        std::upper_bound(band_y_.begin(), band_y_.end(), y) - band_y_.begin() -
+        1);
+    for (int s = band_first_[b]; s < band_first_[b + 1]; ++s) {
+      segment const& seg = segments_[s];
+      f(seg.x0, seg.x1, layers_.data() + seg.first, seg.count);
+    }
+  }
+
+ private:
+  struct segment {
+    int x0;
+    int x1;
+    int first;  // into layers_
+    int count;
+  };
+
+  static bool covers_row(cv::Rect const& rect, int y) {
+    return (rect.area() > 0) && (rect.y <= y) && (y < rect.y + rect.height);
+  }
+
+  cv::Size size_;
+  std::vector<int> band_y_;
+  std::vector<int> band_first_;
+  std::vector<segment> segments_;
+  std::vector<int> layers_;
+};
+}
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <dwango/singleton.hpp>
+#include <dwango/thread_budget.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER) && (_MSC_VER < 1900)
+#define DWANGO_THREAD_LOCAL __declspec(thread)
+#else
+#define DWANGO_THREAD_LOCAL thread_local
+#endif
+
+namespace dwango {
+
+namespace detail {
+
+// true while the current thread runs a part of a parallel loop
+inline bool& in_parallel_loop() {
+  static DWANGO_THREAD_LOCAL bool flag = false;
+  return flag;
+}
+
+// [begin, end) split into chunks that any thread may claim
+class parallel_job {
+ public:
+  using function_type = void (*)(void const*, int, int);
+
+  parallel_job(int begin, int end, int grain, function_type invoke,
+               void const* f)
+      : next_(begin),
+        end_(end),
+        grain_(grain),
+        pending_((end - begin + grain - 1) / grain),
+        invoke_(invoke),
+        f_(f) {}
+
+  // runs one unclaimed chunk; false if there is none left
+  bool run_one() {
+    int const begin = next_.fetch_add(grain_);
+    if (begin >= end_) {
+      return false;
+    }
+    try {
+      invoke_(f_, begin, std::min(begin + grain_, end_));
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!error_) {
+        error_ = std::current_exception();
+      }
+    }
+    if (pending_.fetch_sub(1) == 1) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_.notify_all();
+    }
+    return true;
+  }
+
+  bool exhausted() const { return next_ >= end_; }
+
+  // waits for the chunks claimed by other threads, then rethrows the first
+  // exception thrown by any chunk
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this]() { return pending_ == 0; });
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+ private:
+  std::atomic<int> next_;
+  int const end_;
+  int const grain_;
+  std::atomic<int> pending_;
+  function_type invoke_;
+  void const* f_;
+
+  std::mutex mutex_;
+  std::condition_variable done_;
+  std::exception_ptr error_;
+};
+}
+
+//
+// thread_pool
+//
+// Module-wide pool shared by every compute() call of a plugin. OpenToonz
+// renders several frames and nodes at once; instead of each call opening its
+// own team of threads, concurrent loops hand their chunks to the same
+// workers and the calling threads join in on their own loops.
+//
+// A worker only runs while it holds a slot of the process-wide thread_budget,
+// which the pools of all plugins share; a worker without a slot sleeps until
+// some pool gives one back. The budget is read from DWANGO_PLUGIN_THREADS and
+// defaults to the number of hardware threads. The budget is looked up and
+// the workers start on the first parallel loop, not while the plugin is
+// being loaded.
+//
+// Loops started from inside a parallel loop run inline on the calling thread,
+// so parallelism is never nested. For the same reason OpenCV runs on one
+// thread while any parallel loop of any plugin runs (cv::filter2D or cv::dft
+// inside a loop would otherwise open a team of threads per call); its thread
+// count is restored after the last one.
+//
+// The pool is never destroyed: joining threads from a static destructor can
+// deadlock under the loader lock on Windows. Instead the module is pinned
+// once workers have started, and they end with the process.
+class thread_pool {
+ public:
+  thread_pool() : budget_(nullptr), started_(false), stopping_(false) {}
+
+  static thread_pool& instance() {
+    return detail::leaked_singleton<thread_pool>::instance;
+  }
+
+  int budget() { return shared_budget().threads(); }
+
+  // changes the number of threads of every plugin of the process; call while
+  // no loop is running
+  void set_budget(int threads) {
+    stop();
+    shared_budget().set_threads(std::max(threads, 1));
+  }
+
+  // calls f(b, e) for disjoint blocks [b, e) covering [begin, end)
+  template <typename F>
+  void run(int begin, int end, F const& f) {
+    if (begin >= end) {
+      return;
+    }
+    bool& nested = detail::in_parallel_loop();
+    if (nested) {
+      f(begin, end);
+      return;
+    }
+    start();
+    int const threads = budget_->threads();
+    if ((threads <= 1) || (end - begin < 2)) {
+      f(begin, end);
+      return;
+    }
+    library_limit const limit(*budget_);
+
+    // a few chunks per thread so that idle threads can take over
+    int const grain = std::max((end - begin) / (threads * 4), 1);
+    auto const job = std::make_shared<detail::parallel_job>(
+        begin, end, grain, &invoke<F>, &f);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(job);
+    }
+    wake_.notify_all();
+
+    nested = true;
+    while (job->run_one()) {
+    }
+    nested = false;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto const it = std::find(jobs_.begin(), jobs_.end(), job);
+      if (it != jobs_.end()) {
+        jobs_.erase(it);
+      }
+    }
+    job->wait();
+  }
+
+ private:
+  using job_pointer = std::shared_ptr<detail::parallel_job>;
+
+  template <typename F>
+  static void invoke(void const* f, int begin, int end) {
+    (*static_cast<F const*>(f))(begin, end);
+  }
+
+  // OpenCV on one thread for the lifetime of a parallel loop
+  struct library_limit {
+    explicit library_limit(thread_budget& budget) : budget(budget) {
+      budget.limit_library(&cv::getNumThreads, &cv::setNumThreads);
+    }
+    ~library_limit() { budget.unlimit_library(&cv::setNumThreads); }
+
+    thread_budget& budget;
+  };
+
+  // called by any module when it releases a slot
+  static void wake_workers() {
+    thread_pool& pool = instance();
+    {
+      // a worker between try_acquire() and the wait holds the lock
+      std::lock_guard<std::mutex> lock(pool.mutex_);
+    }
+    pool.wake_.notify_all();
+  }
+
+  static int default_threads() {
+    if (char const* const env = std::getenv("DWANGO_PLUGIN_THREADS")) {
+      int const n = std::atoi(env);
+      if (n > 0) {
+        return n;
+      }
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  thread_budget& shared_budget() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return locked_budget();
+  }
+
+  // under mutex_
+  thread_budget& locked_budget() {
+    if (!budget_) {
+      budget_ = &thread_budget::find(default_threads());
+    }
+    return *budget_;
+  }
+
+  void start() {
+    if (started_) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (started_) {
+      return;
+    }
+    int const threads = locked_budget().threads();
+    if (threads > 1) {
+      detail::pin_module();
+      budget_->add_waker(&wake_workers);
+    }
+    for (int i = 1; i < threads; ++i) {
+      threads_.emplace_back([this]() { work(); });
+    }
+    started_ = true;
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& t : threads_) {
+      t.join();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    threads_.clear();
+    started_ = false;
+    stopping_ = false;
+  }
+
+  void work() {
+    detail::in_parallel_loop() = true;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      wake_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+      if (stopping_) {
+        return;
+      }
+
+      // oldest loop first; finished loops leave the queue
+      job_pointer const job = jobs_.front();
+      if (job->exhausted()) {
+        jobs_.pop_front();
+        continue;
+      }
+
+      // the other plugins use the whole budget; the calling thread keeps the
+      // loop going meanwhile, and a released slot wakes this worker
+      budget_->begin_wait();
+      bool const acquired = budget_->try_acquire();
+      if (!acquired) {
+        wake_.wait(lock);
+      }
+      budget_->end_wait();
+      if (!acquired) {
+        continue;
+      }
+
+      lock.unlock();
+      while (job->run_one()) {
+      }
+      budget_->release();
+      lock.lock();
+    }
+  }
+
+  thread_budget* budget_;  // found on first use
+  std::atomic<bool> started_;
+  bool stopping_;
+  std::vector<std::thread> threads_;
+  std::deque<job_pointer> jobs_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+};
+
+// Calls f(b, e) for disjoint blocks [b, e) covering [begin, end) on the
+// shared pool. Per-block state (e.g. a color_cache) goes at the top of f.
+template <typename F>
+void parallel_for_blocks(int begin, int end, F const& f) {
+  thread_pool::instance().run(begin, end, f);
+}
+
+// Calls f(i) for every i in [begin, end) on the shared pool; a replacement
+// for "#pragma omp parallel for".
+template <typename F>
+void parallel_for(int begin, int end, F const& f) {
+  parallel_for_blocks(begin, end, [&f](int b, int e) {
+    for (int i = b; i < e; ++i) {
+      f(i);
+    }
+  });
+}
+}
@@ -0,0 +1,310 @@
+#pragma once
+
+#include <toonz_utility.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/singleton.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace dwango {
+
+namespace detail {
+
+inline std::uint64_t rotl64(std::uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+inline std::uint64_t read64(unsigned char const* p) {
+  std::uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline std::uint32_t read32(unsigned char const* p) {
+  std::uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// XXH64 (Yann Collet). Fast, non-cryptographic; several GB/s per core.
+class xxhash64 {
+ public:
+  static std::uint64_t hash(void const* data, std::size_t size,
+                            std::uint64_t seed = 0) {
+    unsigned char const* p = static_cast<unsigned char const*>(data);
+    unsigned char const* const end = p + size;
+    std::uint64_t h;
+
+    if (size >= 32) {
+      std::uint64_t v1 = seed + P1 + P2;
+      std::uint64_t v2 = seed + P2;
+      std::uint64_t v3 = seed;
+      std::uint64_t v4 = seed - P1;
+      for (; p + 32 <= end; p += 32) {
+        v1 = round(v1, read64(p + 0));
+        v2 = round(v2, read64(p + 8));
+        v3 = round(v3, read64(p + 16));
+        v4 = round(v4, read64(p + 24));
+      }
+      h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+      h = merge(h, v1);
+      h = merge(h, v2);
+      h = merge(h, v3);
+      h = merge(h, v4);
+    } else {
+      h = seed + P5;
+    }
+    h += size;
+
+    for (; p + 8 <= end; p += 8) {
+      h ^= round(0, read64(p));
+      h = rotl64(h, 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+      h ^= read32(p) * P1;
+      h = rotl64(h, 23) * P2 + P3;
+      p += 4;
+    }
+    for (; p < end; ++p) {
+      h ^= *p * P5;
+      h = rotl64(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+  }
+
+ private:
+  static std::uint64_t const P1 = 11400714785074694791ULL;
+  static std::uint64_t const P2 = 14029467366897019727ULL;
+  static std::uint64_t const P3 = 1609587929392839161ULL;
+  static std::uint64_t const P4 = 9650029242287828579ULL;
+  static std::uint64_t const P5 = 2870177450012600261ULL;
+
+  static std::uint64_t round(std::uint64_t acc, std::uint64_t input) {
+    return rotl64(acc + input * P2, 31) * P1;
+  }
+
+  static std::uint64_t merge(std::uint64_t acc, std::uint64_t v) {
+    return (acc ^ round(0, v)) * P1 + P4;
+  }
+};
+
+inline std::uint64_t hash_combine(std::uint64_t seed, std::uint64_t value) {
+  return xxhash64::hash(&value, sizeof(value), seed);
+}
+
+template <typename T>
+std::uint64_t hash_value(std::uint64_t seed, T const& value) {
+  return xxhash64::hash(&value, sizeof(value), seed);
+}
+
+// Hashes the pixels of m. Bands of rows are hashed in parallel and combined in
+// order, so the result does not depend on the number of threads.
+inline std::uint64_t hash_mat(cv::Mat const& m, std::uint64_t seed) {
+  seed = hash_value(seed, m.type());
+  seed = hash_value(seed, m.cols);
+  seed = hash_value(seed, m.rows);
+
+  int const band = 64;
+  int const count = (m.rows + band - 1) / band;
+  std::size_t const row_size = m.cols * m.elemSize();
+  std::vector<std::uint64_t> digests(count);
+
+  dwango::parallel_for(0, count, [&](int i) {
+    int const y0 = i * band;
+    int const y1 = std::min(y0 + band, m.rows);
+    std::uint64_t h = 0;
+    if (m.isContinuous()) {
+      h = xxhash64::hash(m.ptr(y0), row_size * (y1 - y0));
+    } else {
+      for (int y = y0; y < y1; ++y) {
+        h = xxhash64::hash(m.ptr(y), row_size, h);
+      }
+    }
+    digests[i] = h;
+  });
+
+  for (std::uint64_t h : digests) {
+    seed = hash_combine(seed, h);
+  }
+  return seed;
+}
+}
+
+//
+// result_cache
+//
+// Module-wide LRU cache of compute() results. Each plugin is a separate
+// shared object, so each has its own cache and its own budget.
+//
+// The cache is opt-in: the budget is read from DWANGO_RESULT_CACHE_MB and
+// defaults to 0, which disables it. A render node runs many plugins, and a
+// default budget in each of them would add up.
+class result_cache {
+ public:
+  result_cache() : bytes_(0), budget_(0) {
+    if (char const* const env = std::getenv("DWANGO_RESULT_CACHE_MB")) {
+      budget_ = static_cast<std::size_t>(std::max(std::atol(env), 0L)) << 20;
+    }
+  }
+
+  static result_cache& instance() {
+    return detail::singleton<result_cache>::instance;
+  }
+
+  bool enabled() const { return budget_ > 0; }
+
+  void set_budget(std::size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_ = bytes;
+    evict();
+  }
+
+  // copies the cached result for key into retimg; false on a miss
+  bool fetch(std::uint64_t key, cv::Mat& retimg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto const it = index_.find(key);
+    if (it == index_.end()) {
+      return false;
+    }
+    cv::Mat const& image = it->second->image;
+    if ((image.size() != retimg.size()) || (image.type() != retimg.type())) {
+      return false;
+    }
+    entries_.splice(entries_.begin(), entries_, it->second);
+    image.copyTo(retimg);
+    return true;
+  }
+
+  void store(std::uint64_t key, cv::Mat const& retimg) {
+    std::size_t const size = retimg.total() * retimg.elemSize();
+    if (size > budget_) {
+      return;
+    }
+    cv::Mat image = retimg.clone();  // copy outside of the lock
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index_.count(key)) {
+      return;  // stored concurrently by another thread
+    }
+    entries_.push_front(entry{key, image, size});
+    index_[key] = entries_.begin();
+    bytes_ += size;
+    evict();
+  }
+
+ private:
+  struct entry {
+    std::uint64_t key;
+    cv::Mat image;
+    std::size_t size;
+  };
+
+  // requires mutex_ to be held
+  void evict() {
+    while (bytes_ > budget_) {
+      entry const& last = entries_.back();
+      bytes_ -= last.size;
+      index_.erase(last.key);
+      entries_.pop_back();
+    }
+  }
+
+  std::mutex mutex_;
+  std::list<entry> entries_;
+  std::unordered_map<std::uint64_t, std::list<entry>::iterator> index_;
+  std::size_t bytes_;
+  std::atomic<std::size_t> budget_;  // written under mutex_
+};
+
+enum frame_dependency {
+  independent_of_frame,
+  depends_on_frame,
+};
+
+//
+// memoized
+//
+// Wraps a plugin's Fx so that a request identical to a previous one returns
+// the previous result. In limited animation a drawing is typically held for
+// 2-3 frames, so most frames repeat the previous request exactly.
+//
+// The key is a hash of the pixels, positions and sizes of the connected ports,
+// all parameter values, the output size and type, and config.frame for
+// plugins constructed with depends_on_frame. Plugins opt in from make_fx():
+//
+//   Fx* make_fx() { return new dwango::memoized<MyFx>(); }
+template <typename Base>
+class memoized : public Base {
+ public:
+  using Config = tnzu::Fx::Config;
+  using Params = tnzu::Fx::Params;
+  using Args = tnzu::Fx::Args;
+
+  explicit memoized(frame_dependency dependency = independent_of_frame)
+      : dependency_(dependency) {}
+
+  int compute(Config const& config, Params const& params, Args const& args,
+              cv::Mat& retimg) override {
+    result_cache& cache = result_cache::instance();
+    if (!cache.enabled()) {
+      return Base::compute(config, params, args, retimg);
+    }
+
+    std::uint64_t const key = make_key(config, params, args, retimg);
+    if (cache.fetch(key, retimg)) {
+      DEBUG_PRINT("result cache hit");
+      return 0;
+    }
+
+    int const ret = Base::compute(config, params, args, retimg);
+    if (ret == 0) {
+      cache.store(key, retimg);
+    }
+    return ret;
+  }
+
+ private:
+  std::uint64_t make_key(Config const& config, Params const& params,
+                         Args const& args, cv::Mat const& retimg) const {
+    std::uint64_t h = 0;
+    h = detail::hash_value(h, retimg.type());
+    h = detail::hash_value(h, retimg.cols);
+    h = detail::hash_value(h, retimg.rows);
+
+    for (int i = 0; i < this->param_count(); ++i) {
+      h = detail::hash_value(h, params.template get<double>(i));
+    }
+    if (dependency_ == depends_on_frame) {
+      h = detail::hash_value(h, config.frame);
+    }
+
+    for (int i = 0; i < args.count(); ++i) {
+      if (args.invalid(i)) {
+        h = detail::hash_value(h, -1);
+        continue;
+      }
+      cv::Point2d const offset = args.offset(i);
+      h = detail::hash_value(h, offset.x);
+      h = detail::hash_value(h, offset.y);
+      h = detail::hash_mat(args.get(i), h);
+    }
+    return h;
+  }
+
+  frame_dependency dependency_;
+};
+}
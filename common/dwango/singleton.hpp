@@ -0,0 +1,27 @@
+#pragma once
+
+namespace dwango {
+
+namespace detail {
+
+// Module-wide instance in static storage, constructed at load time.
+// Function-local statics are not thread-safe on VS2013.
+template <typename T>
+struct singleton {
+  static T instance;
+};
+
+template <typename T>
+T singleton<T>::instance;
+
+// Same, but never destroyed, for instances that own threads: these must not
+// be joined from a static destructor.
+template <typename T>
+struct leaked_singleton {
+  static T& instance;
+};
+
+template <typename T>
+T& leaked_singleton<T>::instance = *new T;
+}
+}
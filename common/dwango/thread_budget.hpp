@@ -0,0 +1,279 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace dwango {
+
+namespace detail {
+
+// Keeps the module that contains this function loaded until the process
+// exits. Called before a module starts threads that run its code.
+inline void pin_module() {
+#if defined(_WIN32)
+  HMODULE module;
+  GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                         GET_MODULE_HANDLE_EX_FLAG_PIN,
+                     reinterpret_cast<LPCSTR>(&pin_module), &module);
+#else
+  Dl_info info;
+  if (dladdr(reinterpret_cast<void*>(&pin_module), &info) && info.dli_fname) {
+    dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD | RTLD_NODELETE);
+  }
+#endif
+}
+
+#if !defined(_WIN32)
+inline void thread_budget_name(char* name, std::size_t size) {
+  std::snprintf(name, size, "/dwango_threads.%ld",
+                static_cast<long>(getpid()));
+}
+
+inline void unlink_thread_budget() {
+  char name[64];
+  thread_budget_name(name, sizeof(name));
+  shm_unlink(name);
+}
+#endif
+
+// Zero-filled memory of the given size that every module of the process
+// maps by the same name; nullptr if the system refuses. Creating and opening
+// are one atomic step, so modules loaded at the same time agree on it.
+inline void* map_process_memory(std::size_t size) {
+#if defined(_WIN32)
+  // a page file backed mapping; it goes away with the process
+  char name[64];
+  std::sprintf(name, "Local\\dwango_threads.%lu",
+               static_cast<unsigned long>(GetCurrentProcessId()));
+  HANDLE const mapping =
+      CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0,
+                         static_cast<DWORD>(size), name);
+  if (!mapping) {
+    return nullptr;
+  }
+  return MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+#else
+  char name[64];
+  thread_budget_name(name, sizeof(name));
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  bool const created = (fd >= 0);
+  if (created) {
+    // the creator keeps the name until the process exits
+    pin_module();
+    std::atexit(&unlink_thread_budget);
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+      close(fd);
+      return nullptr;
+    }
+  } else if (errno == EEXIST) {
+    fd = shm_open(name, O_RDWR, 0600);
+    if (fd < 0) {
+      return nullptr;
+    }
+    // the creator may not have sized it yet
+    struct stat st;
+    while ((fstat(fd, &st) == 0) &&
+           (st.st_size < static_cast<off_t>(size))) {
+      std::this_thread::yield();
+    }
+  } else {
+    return nullptr;
+  }
+  void* const memory =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return (memory == MAP_FAILED) ? nullptr : memory;
+#endif
+}
+}
+
+//
+// thread_budget
+//
+// Number of worker threads that the plugins of a process may run at once.
+// Each plugin is a separate module with its own thread_pool, and these pools
+// draw from one budget, so rendering with several plugins does not start
+// more threads than the machine has.
+//
+// The budget lives in a named shared memory object of the process (a file
+// mapping on Windows, shm_open elsewhere), which the first module to run a
+// parallel loop creates and the others open. All of its state starts as
+// zeros, so it needs no initialization step that other modules could
+// observe half done. If the object cannot be created, the module falls back
+// to a budget of its own.
+//
+// Besides the thread count, it holds what the modules must agree on while
+// they share threads: the workers that wait for a slot, the functions that
+// wake them, and the thread counts of libraries (OpenCV) that are limited
+// while parallel loops run.
+class thread_budget {
+ public:
+  enum { max_wakers = 64, max_libraries = 32 };
+
+  using get_threads_type = int (*)();
+  using set_threads_type = void (*)(int);
+  using wake_type = void (*)();
+
+  // the budget of this process; threads is used by the first module
+  static thread_budget& find(int threads) {
+    thread_budget* budget = static_cast<thread_budget*>(
+        detail::map_process_memory(sizeof(thread_budget)));
+    if (!budget) {
+      budget = new thread_budget();
+    }
+    int expected = 0;
+    budget->threads_.compare_exchange_strong(expected, threads);
+    return *budget;
+  }
+
+  // total number of threads, including one thread that calls into a plugin
+  int threads() const { return threads_; }
+
+  // changes the total; call while no loop is running
+  void set_threads(int threads) { threads_ = threads; }
+
+  // takes a worker slot; false if all are in use
+  bool try_acquire() {
+    int n = used_.load();
+    while (n < threads_ - 1) {
+      if (used_.compare_exchange_weak(n, n + 1)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // gives a slot back and wakes the workers waiting for one; call without
+  // holding a lock that a wake function takes
+  void release() {
+    --used_;
+    if (waiting_ > 0) {
+      for (int i = 0; i < max_wakers; ++i) {
+        if (std::uintptr_t const wake = wakers_[i]) {
+          reinterpret_cast<wake_type>(wake)();
+        }
+      }
+    }
+  }
+
+  // A worker that finds no slot waits until release() calls the wake
+  // function of its module:
+  //
+  //   begin_wait();
+  //   if (!try_acquire()) { (wait under the lock that wake takes) }
+  //   end_wait();
+  //
+  // begin_wait() comes before try_acquire() so that a release in between
+  // sees the waiter. The module that registers wake must stay loaded.
+  void add_waker(wake_type wake) {
+    std::uintptr_t const value = reinterpret_cast<std::uintptr_t>(wake);
+    for (int i = 0; i < max_wakers; ++i) {
+      std::uintptr_t expected = 0;
+      if (wakers_[i].compare_exchange_strong(expected, value) ||
+          (expected == value)) {
+        return;
+      }
+    }
+    // full: the workers of this module are only woken by its own loops
+  }
+
+  void begin_wait() { ++waiting_; }
+  void end_wait() { --waiting_; }
+
+  // Limits a library to one thread while at least one parallel loop of any
+  // module runs, and restores its thread count after the last one. Modules
+  // linked to the same copy of the library pass the same set function.
+  void limit_library(get_threads_type get, set_threads_type set) {
+    lock();
+    if (library* const l = find_library(set)) {
+      if (l->users++ == 0) {
+        l->saved = get();
+        set(1);
+      }
+    }
+    unlock();
+  }
+
+  void unlimit_library(set_threads_type set) {
+    lock();
+    if (library* const l = find_library(set)) {
+      if (--l->users == 0) {
+        set(l->saved);
+      }
+    }
+    unlock();
+  }
+
+ private:
+  // shared by modules that may be built with different compilers, so only
+  // plain lock-free atomics
+  struct library {
+    std::atomic<std::uintptr_t> key;
+    std::atomic<int> users;
+    std::atomic<int> saved;
+  };
+
+  thread_budget() : threads_(0), used_(0), waiting_(0), lock_(0) {
+    for (int i = 0; i < max_wakers; ++i) {
+      wakers_[i] = 0;
+    }
+    for (int i = 0; i < max_libraries; ++i) {
+      libraries_[i].key = 0;
+      libraries_[i].users = 0;
+      libraries_[i].saved = 0;
+    }
+  }
+
+  void lock() {
+    int expected = 0;
+    while (!lock_.compare_exchange_weak(expected, 1)) {
+      expected = 0;
+      std::this_thread::yield();
+    }
+  }
+
+  void unlock() { lock_ = 0; }
+
+  // under lock(); nullptr if the table is full
+  library* find_library(set_threads_type set) {
+    std::uintptr_t const key = reinterpret_cast<std::uintptr_t>(set);
+    for (int i = 0; i < max_libraries; ++i) {
+      library& l = libraries_[i];
+      if (!l.key) {
+        l.key = key;
+      }
+      if (l.key == key) {
+        return &l;
+      }
+    }
+    return nullptr;
+  }
+
+  std::atomic<int> threads_;  // 0 until the first module sets it
+  std::atomic<int> used_;
+  std::atomic<int> waiting_;
+  std::atomic<int> lock_;
+  std::atomic<std::uintptr_t> wakers_[max_wakers];
+  library libraries_[max_libraries];
+};
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <dwango/parallel.hpp>
+#include <dwango/singleton.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace dwango {
+
+namespace detail {
+
+inline bool all_zero(void const* data, std::size_t size) {
+  unsigned char const* p = static_cast<unsigned char const*>(data);
+  std::uint64_t bits = 0;
+  std::size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    std::uint64_t v;
+    std::memcpy(&v, p + i, sizeof(v));
+    bits |= v;
+  }
+  for (; i < size; ++i) {
+    bits |= p[i];
+  }
+  return bits == 0;
+}
+}
+
+//
+// tile_statistics
+//
+// Module-wide counters of classified tiles, read by the benchmark. Setting
+// disabled makes every tile classify as mixed, i.e. turns the tile paths off.
+struct tile_statistics {
+  static tile_statistics& instance() {
+    return detail::singleton<tile_statistics>::instance;
+  }
+
+  void reset() {
+    tiles = 0;
+    empty = 0;
+    uniform = 0;
+  }
+
+  // zero-initialized in static storage
+  std::atomic<std::uint64_t> tiles;
+  std::atomic<std::uint64_t> empty;
+  std::atomic<std::uint64_t> uniform;
+  std::atomic<bool> disabled;
+};
+
+//
+// tile_map
+//
+// Classification of an image split into square tiles.
+//
+//   empty   every channel of every pixel is zero, which is what the
+//           transparent part of a cel looks like; kernels skip these tiles
+//   uniform every pixel is identical (flat fills); point operations evaluate
+//           one pixel and fill the tile with the result
+//   mixed   anything else
+class tile_map {
+ public:
+  static int const tile_size = 64;
+
+  enum state_type : unsigned char {
+    empty,
+    uniform,
+    mixed,
+  };
+
+  // all tiles of an image of the given size, initially empty
+  explicit tile_map(cv::Size size)
+      : size_(size),
+        cols_((size.width + tile_size - 1) / tile_size),
+        rows_((size.height + tile_size - 1) / tile_size),
+        states_(cols_ * rows_, empty) {}
+
+  // classifies the tiles of image (any element type)
+  explicit tile_map(cv::Mat const& image) : tile_map(image.size()) {
+    tile_statistics& stats = tile_statistics::instance();
+    if (stats.disabled) {
+      std::fill(states_.begin(), states_.end(), mixed);
+      return;
+    }
+
+    dwango::parallel_for(0, rows_, [&](int ty) {
+      for (int tx = 0; tx < cols_; ++tx) {
+        states_[ty * cols_ + tx] = classify(image, tile_rect(tx, ty));
+      }
+    });
+
+    stats.tiles += states_.size();
+    stats.empty += std::count(states_.begin(), states_.end(), empty);
+    stats.uniform += std::count(states_.begin(), states_.end(), uniform);
+  }
+
+  cv::Size size() const { return size_; }
+  int cols() const { return cols_; }
+  int rows() const { return rows_; }
+
+  state_type state(int tx, int ty) const {
+    return static_cast<state_type>(states_[ty * cols_ + tx]);
+  }
+  bool occupied(int tx, int ty) const { return state(tx, ty) != empty; }
+
+  // pixels covered by tile (tx, ty)
+  cv::Rect tile_rect(int tx, int ty) const {
+    cv::Rect const rect(tx * tile_size, ty * tile_size, tile_size, tile_size);
+    return rect & cv::Rect(cv::Point(0, 0), size_);
+  }
+
+  // marks every tile that intersects rect as mixed
+  void mark(cv::Rect rect) {
+    rect &= cv::Rect(cv::Point(0, 0), size_);
+    if (rect.area() <= 0) {
+      return;
+    }
+    int const tx1 = (rect.x + rect.width - 1) / tile_size;
+    int const ty1 = (rect.y + rect.height - 1) / tile_size;
+    for (int ty = rect.y / tile_size; ty <= ty1; ++ty) {
+      for (int tx = rect.x / tile_size; tx <= tx1; ++tx) {
+        states_[ty * cols_ + tx] = mixed;
+      }
+    }
+  }
+
+  // marks the occupied tiles of other, placed at offset
+  void merge(tile_map const& other, cv::Point offset) {
+    for (int ty = 0; ty < other.rows(); ++ty) {
+      for (int tx = 0; tx < other.cols(); ++tx) {
+        if (other.occupied(tx, ty)) {
+          mark(other.tile_rect(tx, ty) + offset);
+        }
+      }
+    }
+  }
+
+  // calls f(x0, x1, occupied) for the runs of tiles on row y with the same
+  // occupancy, from left to right
+  template <typename F>
+  void spans(int y, F f) const {
+    spans(y, 0, size_.width, f);
+  }
+
+  // same as above, clipped to the columns [x0, x1)
+  template <typename F>
+  void spans(int y, int x0, int x1, F f) const {
+    x0 = std::max(x0, 0);
+    x1 = std::min(x1, size_.width);
+    if (x0 >= x1) {
+      return;
+    }
+    unsigned char const* row = &states_[(y / tile_size) * cols_];
+    int tx = x0 / tile_size;
+    int const tx1 = (x1 - 1) / tile_size + 1;
+    while (tx < tx1) {
+      bool const occupied = row[tx] != empty;
+      int end = tx + 1;
+      while ((end < tx1) && ((row[end] != empty) == occupied)) {
+        ++end;
+      }
+      f(std::max(tx * tile_size, x0), std::min(end * tile_size, x1), occupied);
+      tx = end;
+    }
+  }
+
+  // calls f(x0, x1, state) for the tiles on row y, from left to right.
+  // Adjacent empty or mixed tiles are merged into one call; uniform tiles are
+  // passed one at a time since their values differ.
+  template <typename F>
+  void runs(int y, F f) const {
+    unsigned char const* row = &states_[(y / tile_size) * cols_];
+    int tx = 0;
+    while (tx < cols_) {
+      state_type const state = static_cast<state_type>(row[tx]);
+      int end = tx + 1;
+      if (state != uniform) {
+        while ((end < cols_) && (row[end] == state)) {
+          ++end;
+        }
+      }
+      f(tx * tile_size, std::min(end * tile_size, size_.width), state);
+      tx = end;
+    }
+  }
+
+  // combines two classifications of the same area: a tile is uniform only if
+  // it is uniform in both, and empty only if it is empty in both
+  void intersect(tile_map const& other) {
+    for (std::size_t i = 0; i < states_.size(); ++i) {
+      states_[i] = std::max(states_[i], other.states_[i]);
+    }
+  }
+
+ private:
+  static state_type classify(cv::Mat const& image, cv::Rect const& rect) {
+    std::size_t const elem_size = image.elemSize();
+    std::size_t const row_size = rect.width * elem_size;
+    unsigned char const* const first = image.ptr(rect.y) + rect.x * elem_size;
+
+    for (int y = rect.y; y < rect.y + rect.height; ++y) {
+      unsigned char const* row = image.ptr(y) + rect.x * elem_size;
+      // each pixel equals its left neighbor, and the row starts with the
+      // first pixel of the tile
+      if ((std::memcmp(row, first, elem_size) != 0) ||
+          (std::memcmp(row, row + elem_size, row_size - elem_size) != 0)) {
+        return mixed;
+      }
+    }
+    return detail::all_zero(first, elem_size) ? empty : uniform;
+  }
+
+  cv::Size size_;
+  int cols_;
+  int rows_;
+  std::vector<unsigned char> states_;
+};
+}